@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static char MAIN_PROGRAM_NAME[] = "main";
+
+static const char *strategies[] = {"atomic", "mutex", "local"};
+
+void print(const char *text)
+{
+    if (!text)
+        return;
+
+    if (write(STDOUT_FILENO, text, strlen(text)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+// runs main once with its stdout discarded, returns the wall time in ms
+double run_once(const char *path, int threads, const char *count_rounds, const char *strategy)
+{
+    struct timespec start, stop;
+    char threads_arg[16];
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+    switch (child)
+    {
+    case -1:
+    {
+        const char msg[] = "error: failed to spawn new process\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    case 0:
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1 || dup2(null_fd, STDERR_FILENO) == -1)
+            _exit(EXIT_FAILURE);
+
+        char *const args[] = {MAIN_PROGRAM_NAME, threads_arg, (char *)count_rounds,
+                              "--reduce", (char *)strategy, NULL};
+        execv(path, args);
+        _exit(EXIT_FAILURE);
+    }
+    }
+
+    int child_status;
+    if (waitpid(child, &child_status, 0) == -1 || !WIFEXITED(child_status) ||
+        WEXITSTATUS(child_status) != EXIT_SUCCESS)
+    {
+        const char msg[] = "error: main exited with error\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    return (stop.tv_sec - start.tv_sec) * 1e3 + (stop.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    int repeats = 5, max_threads = 2 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *output = NULL;
+    if (argc < 2)
+    {
+        print("Input error. Enter <program_name><count_rounds>[--repeats <n>][--max-threads <n>][--output <file.csv>]\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 2; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--repeats") && i + 1 < argc)
+            repeats = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--max-threads") && i + 1 < argc)
+            max_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+            output = argv[++i];
+        else
+        {
+            print("Input error. Unknown option\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (repeats <= 0 || max_threads <= 0)
+    {
+        print("Input error. Repeats and thread count must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char path[1024];
+    {
+        ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (len == -1)
+        {
+            const char msg[] = "error: failed to read full program path\n";
+            write(STDERR_FILENO, msg, sizeof(msg));
+            exit(EXIT_FAILURE);
+        }
+        while (path[len] != '/')
+            --len;
+        path[len] = '\0';
+        strncat(path, "/", sizeof(path) - strlen(path) - 1);
+        strncat(path, MAIN_PROGRAM_NAME, sizeof(path) - strlen(path) - 1);
+    }
+
+    FILE *csv = output ? fopen(output, "w") : stdout;
+    if (!csv)
+    {
+        const char msg[] = "error: failed to open output file\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(csv, "strategy,threads,repeats,wall_ms_mean,wall_ms_min,wall_ms_max,speedup,efficiency\n");
+
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); ++s)
+    {
+        double base = 0;
+        for (int threads = 1; threads <= max_threads; ++threads)
+        {
+            double sum = 0, min = 0, max = 0;
+            for (int r = 0; r < repeats; ++r)
+            {
+                double wall = run_once(path, threads, argv[1], strategies[s]);
+                sum += wall;
+                if (r == 0 || wall < min)
+                    min = wall;
+                if (wall > max)
+                    max = wall;
+            }
+            double mean = sum / repeats;
+            if (threads == 1)
+                base = mean;
+            fprintf(csv, "%s,%d,%d,%.3lf,%.3lf,%.3lf,%.3lf,%.3lf\n", strategies[s], threads, repeats,
+                    mean, min, max, base / mean, base / mean / threads);
+            fflush(csv);
+        }
+    }
+
+    if (output && fclose(csv))
+    {
+        const char msg[] = "error: failed to close output file\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
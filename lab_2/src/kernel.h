@@ -0,0 +1,67 @@
+
+#ifndef __KERNEL_H
+#define __KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Monte Carlo experiment plugin: every trial is either a success or not.
+// Each worker thread calls kernel_thread_init once and then kernel_run for
+// every chunk of trials it takes, passing the chunk's own random stream.
+// When the pool stops, the states are folded into the first one with
+// kernel_merge, the optional kernel_report adds lines to the output, and
+// every state is released with kernel_thread_destroy.
+//
+// The optional kernel_save and kernel_load carry a state between
+// processes: kernel_save writes it into buffer and returns its size, 0 if
+// it does not fit; kernel_load reads it into a state fresh from
+// kernel_thread_init and returns 0 on success. With them merge reports the
+// plugin over all shards and --resume over the trials before the
+// checkpoint too; a plugin with kernel_report but without them can not be
+// run with --shard or --checkpoint.
+
+typedef void *kernel_thread_init_f(const int thread_id);
+typedef uint64_t kernel_run_f(void *const state, uint64_t *const rng, const uint64_t first_trial, const uint64_t count);
+typedef void kernel_merge_f(void *const state, const void *const other);
+typedef void kernel_report_f(const void *const state, char *const text, const size_t size);
+typedef void kernel_thread_destroy_f(void *const state);
+typedef size_t kernel_save_f(const void *const state, void *const buffer, const size_t size);
+typedef int kernel_load_f(void *const state, const void *const buffer, const size_t size);
+
+#define KERNEL_STATE_MAX 4096 // bytes kernel_save may write
+
+// splitmix64: one 64-bit random number per call
+static inline uint64_t kernel_random(uint64_t *const rng)
+{
+    uint64_t z = (*rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// maps 32 random bits to [0, n)
+static inline int kernel_bounded(const uint32_t bits, const int n)
+{
+    return (int)(((uint64_t)bits * n) >> 32);
+}
+
+// uniform double in [0, 1)
+static inline double kernel_uniform(uint64_t *const rng)
+{
+    return (kernel_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#define KERNEL_STREAMS (UINT64_C(1) << 32) // chunks with streams of their own
+
+// Start of the random stream of a chunk: the streams of chunks below
+// KERNEL_STREAMS are disjoint slices of one splitmix64 sequence, up to
+// 2^32 draws each. Chunk c + KERNEL_STREAMS repeats the stream of chunk c,
+// so a run must stay below that many chunks
+static inline uint64_t kernel_stream(const uint64_t seed, const uint64_t chunk)
+{
+    return seed + (chunk << 32) * 0x9E3779B97F4A7C15ULL;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include "kernel.h"
+
+#ifdef _MSC_VER
+#define EXPORT __declspec(dllexport)
+#else
+#define EXPORT
+#endif
+
+// Random point of the unit square falls into the quarter circle,
+// the probability is pi / 4
+typedef struct pi_state
+{
+    uint64_t hits;
+    uint64_t trials;
+} pi_state;
+
+EXPORT void *kernel_thread_init(const int thread_id)
+{
+    (void)thread_id;
+    return calloc(1, sizeof(pi_state));
+}
+
+EXPORT uint64_t kernel_run(void *const state, uint64_t *const rng, const uint64_t first_trial, const uint64_t count)
+{
+    pi_state *pi = (pi_state *)state;
+    uint64_t hits = 0;
+    (void)first_trial;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        double x = kernel_uniform(rng), y = kernel_uniform(rng);
+        if (x * x + y * y < 1.0)
+            hits++;
+    }
+    pi->hits += hits;
+    pi->trials += count;
+    return hits;
+}
+
+EXPORT void kernel_merge(void *const state, const void *const other)
+{
+    pi_state *pi = (pi_state *)state;
+    const pi_state *pi_other = (const pi_state *)other;
+    pi->hits += pi_other->hits;
+    pi->trials += pi_other->trials;
+}
+
+EXPORT void kernel_report(const void *const state, char *const text, const size_t size)
+{
+    const pi_state *pi = (const pi_state *)state;
+    snprintf(text, size, "pi: %.6lf\n", pi->trials ? 4.0 * pi->hits / pi->trials : 0.);
+}
+
+EXPORT size_t kernel_save(const void *const state, void *const buffer, const size_t size)
+{
+    if (size < sizeof(pi_state))
+        return 0;
+    memcpy(buffer, state, sizeof(pi_state));
+    return sizeof(pi_state);
+}
+
+EXPORT int kernel_load(void *const state, const void *const buffer, const size_t size)
+{
+    if (size != sizeof(pi_state))
+        return -1;
+    memcpy(state, buffer, sizeof(pi_state));
+    return 0;
+}
+
+EXPORT void kernel_thread_destroy(void *const state)
+{
+    free(state);
+}
@@ -0,0 +1,216 @@
+#ifndef __LIB_H
+#define __LIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+
+#include "kernel.h"
+
+#define PARTIAL_MAGIC "lab2-partial"
+#define PARTIAL_VERSION 3
+
+// fewer chunks than this give a too noisy batch-means variance
+#define MIN_BATCHES 30
+
+// Running totals of a simulation. The per-chunk sums give the batch-means
+// variance of the estimate, which stays valid when the trials inside a
+// chunk are correlated (stratified, antithetic and shuffle sampling)
+typedef struct tally
+{
+    uint64_t successes;
+    uint64_t trials;
+    uint64_t chunks;
+    uint64_t sum_k2; // sum of squared chunk successes
+    uint64_t sum_nk; // sum of chunk trials * chunk successes
+    uint64_t sum_n2; // sum of squared chunk trials
+} tally_t;
+
+// Result of one --shard run. The shard covers the trials
+// [first_test, first_test + slice) of the whole run; tally.trials is the
+// completed prefix of that slice (less than slice when stopped early).
+// With --kernel the merged plugin state of those trials goes along
+typedef struct partial
+{
+    char event[16];
+    char sampling[16];
+    uint64_t seed;
+    int shard;
+    int count_shards;
+    uint64_t rounds;
+    uint64_t first_test;
+    uint64_t slice;
+    tally_t tally;
+    size_t kernel_size; // 0 - no plugin state
+    unsigned char kernel_state[KERNEL_STATE_MAX];
+} partial_t;
+
+// Acklam's rational approximation of the inverse standard normal CDF
+static inline double normal_quantile(double p)
+{
+    static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+                               1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+    static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+                               6.680131188771972e+01, -1.328068155288572e+01};
+    static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                               -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+    static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+                               3.754408661907416e+00};
+    double q, r;
+
+    if (p < 0.02425)
+    {
+        q = sqrt(-2 * log(p));
+        return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+               ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    }
+    if (p > 1 - 0.02425)
+        return -normal_quantile(1 - p);
+
+    q = p - 0.5;
+    r = q * q;
+    return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+           (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+}
+
+// Wilson score interval for the proportion p observed on n trials
+static inline void wilson_interval(double p, double n, double z, double *low, double *high)
+{
+    double denom = 1 + z * z / n;
+    double center = (p + z * z / (2 * n)) / denom;
+    double half = z / denom * sqrt(p * (1 - p) / n + z * z / (4 * n * n));
+    *low = center - half;
+    *high = center + half;
+}
+
+static inline void tally_add(tally_t *sum, const tally_t *other)
+{
+    sum->successes += other->successes;
+    sum->trials += other->trials;
+    sum->chunks += other->chunks;
+    sum->sum_k2 += other->sum_k2;
+    sum->sum_nk += other->sum_nk;
+    sum->sum_n2 += other->sum_n2;
+}
+
+// Effective sample size: the number of independent trials that would give
+// the same variance. Falls back to the trial count while there are too few
+// chunks to estimate the variance
+static inline double tally_ess(const tally_t *tally)
+{
+    double n = tally->trials, m = tally->chunks, p = (double)tally->successes / n;
+    if (tally->chunks < MIN_BATCHES || p <= 0 || p >= 1)
+        return n;
+
+    // sum over chunks of (k - p * n_chunk)^2
+    double squares = (double)tally->sum_k2 - 2 * p * tally->sum_nk + p * p * tally->sum_n2;
+    if (squares <= 0)
+        return n;
+    return p * (1 - p) / (squares * m / (m - 1) / (n * n));
+}
+
+// Wilson interval over the effective sample size when batch_variance is
+// set, over the plain trial count otherwise
+static inline void tally_interval(const tally_t *tally, bool batch_variance, double z, double *low, double *high)
+{
+    double p = (double)tally->successes / tally->trials;
+    wilson_interval(p, batch_variance ? tally_ess(tally) : tally->trials, z, low, high);
+}
+
+// accepts fractions ("0.0001") and percents ("0.01%")
+static inline double parse_fraction(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text)
+        return -1;
+    if (*end == '%')
+    {
+        value /= 100;
+        end++;
+    }
+    return (*end == '\0') ? value : -1;
+}
+
+// writes a temporary file and renames it, so a reader never sees half a file
+static inline int partial_write(const char *path, const partial_t *part)
+{
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file)
+        return -1;
+    fprintf(file, "%s %d\nevent %s\nsampling %s\nseed %" PRIu64 "\nshard %d %d\nrounds %" PRIu64 "\n"
+                  "first %" PRIu64 "\nslice %" PRIu64 "\ntrials %" PRIu64 "\nsuccesses %" PRIu64 "\n"
+                  "chunks %" PRIu64 "\nsum_k2 %" PRIu64 "\nsum_nk %" PRIu64 "\nsum_n2 %" PRIu64 "\n",
+            PARTIAL_MAGIC, PARTIAL_VERSION, part->event, part->sampling, part->seed, part->shard,
+            part->count_shards, part->rounds, part->first_test, part->slice, part->tally.trials,
+            part->tally.successes, part->tally.chunks, part->tally.sum_k2, part->tally.sum_nk, part->tally.sum_n2);
+    // the plugin state as hex digits, "-" when there is none
+    fprintf(file, "kernel %s", part->kernel_size ? "" : "-");
+    for (size_t i = 0; i < part->kernel_size; ++i)
+        fprintf(file, "%02x", part->kernel_state[i]);
+    fprintf(file, "\n");
+    if (fclose(file))
+        return -1;
+    return rename(tmp_path, path);
+}
+
+static inline int hex_digit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static inline int partial_read_kernel(FILE *file, partial_t *part)
+{
+    char word[8];
+    part->kernel_size = 0;
+    if (fscanf(file, " %7s ", word) != 1 || strcmp(word, "kernel"))
+        return -1;
+    int high = getc(file);
+    if (high == '-')
+        return 0;
+    for (; hex_digit(high) != -1; high = getc(file))
+    {
+        int low = hex_digit(getc(file));
+        if (low == -1 || part->kernel_size == KERNEL_STATE_MAX)
+            return -1;
+        part->kernel_state[part->kernel_size++] = hex_digit(high) << 4 | low;
+    }
+    return part->kernel_size ? 0 : -1;
+}
+
+static inline int partial_read(const char *path, partial_t *part)
+{
+    char magic[32];
+    int version;
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+    int fields = fscanf(file, "%31s %d event %15s sampling %15s seed %" SCNu64 " shard %d %d rounds %" SCNu64
+                              " first %" SCNu64 " slice %" SCNu64 " trials %" SCNu64 " successes %" SCNu64
+                              " chunks %" SCNu64 " sum_k2 %" SCNu64 " sum_nk %" SCNu64 " sum_n2 %" SCNu64,
+                        magic, &version, part->event, part->sampling, &part->seed, &part->shard,
+                        &part->count_shards, &part->rounds, &part->first_test, &part->slice,
+                        &part->tally.trials, &part->tally.successes, &part->tally.chunks,
+                        &part->tally.sum_k2, &part->tally.sum_nk, &part->tally.sum_n2);
+    int kernel = (fields == 16) ? partial_read_kernel(file, part) : -1;
+    fclose(file);
+    if (fields != 16 || kernel || strcmp(magic, PARTIAL_MAGIC) || version != PARTIAL_VERSION ||
+        part->shard < 0 || part->shard >= part->count_shards || part->tally.trials > part->slice ||
+        part->tally.successes > part->tally.trials)
+        return -1;
+    return 0;
+}
+
+#endif
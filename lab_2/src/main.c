@@ -1,11 +1,110 @@
+#define _GNU_SOURCE
 #include "stdio.h"
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <dlfcn.h>
 
-atomic_int success_events = 0;
+#include "lib.h"
+#include "kernel.h"
+
+// multiple of 52 and 26, so stratified and shuffle sampling
+// never split a stratum round or a shuffled deck between chunks
+#define CHUNK_SIZE 65520
+#define MONITOR_INTERVAL_MS 10
+#define PROGRESS_INTERVAL_MS 200
+#define CACHE_LINE 64
+#define PERF_COUNTERS 4
+#define CHECKPOINT_OVERHEAD 0.01 // the longest share of the run spent on checkpoints
+// round limit when only --time-budget or --precision bounds the run
+#define UNBOUNDED_ROUNDS (KERNEL_STREAMS * CHUNK_SIZE) // every chunk still gets a stream of its own
+
+atomic_ullong next_test = 0;
+atomic_bool stop_tests = false;
+
+// how the workers combine their success counts
+typedef enum reduce_mode
+{
+    REDUCE_LOCAL,  // per-thread slots summed by the main thread
+    REDUCE_ATOMIC, // shared atomic counter
+    REDUCE_MUTEX   // shared counter under a mutex
+} reduce_mode_t;
+
+reduce_mode_t reduce_mode = REDUCE_LOCAL;
+atomic_ullong success_events = 0;
+uint64_t locked_success_events = 0;
+pthread_mutex_t success_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the pair of cards counts as a success when they share
+typedef enum event
+{
+    EVENT_SUIT,
+    EVENT_RANK
+} event_t;
+
+static const char *event_names[] = {"suit", "rank"};
+
+// how a chunk draws its card pairs
+typedef enum sampling
+{
+    SAMPLING_PLAIN,      // two random distinct cards per trial
+    SAMPLING_STRATIFIED, // first card runs over the deck in turn, second is random
+    SAMPLING_ANTITHETIC, // trials in pairs, the second card of the partner is moved half the deck away
+    SAMPLING_SHUFFLE     // a shuffled deck gives 26 disjoint pairs; as many draws as plain, no gain for this experiment
+} sampling_t;
+
+static const char *sampling_names[] = {"plain", "stratified", "antithetic", "shuffle"};
+
+// one simulation request, run by the whole pool
+typedef struct job
+{
+    event_t event;
+    sampling_t sampling;
+    uint64_t first_test; // trials [first_test, first_test + count_rounds) of the seed's stream
+    uint64_t count_rounds;
+    uint64_t seed;
+    double precision;   // target half-width of the confidence interval, 0 - run all count_rounds
+    double confidence;
+    double z_score;
+    double time_budget; // seconds, 0 - no time limit
+    tally_t resumed;    // trials [first_test, first_test + resumed.trials) done before --resume
+} job_t;
+
+job_t job;
+
+// workers sleep between jobs and wake up when job_generation changes
+unsigned job_generation = 0;
+bool pool_shutdown = false;
+int running_workers;
+pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_started = PTHREAD_COND_INITIALIZER;
+pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
+
+// --checkpoint: workers park at a chunk boundary while the monitor writes
+// the tally, so the finished trials always form a prefix of the job
+atomic_bool pause_tests;
+int paused_workers = 0;
+pthread_cond_t job_resumed = PTHREAD_COND_INITIALIZER;
+const char *checkpoint_path = NULL;
+double checkpoint_interval = 60;
+partial_t checkpoint;
+int count_checkpoints = 0;
+double checkpoint_time = 0; // seconds the workers spent parked or writing
 
 typedef struct Cards
 {
@@ -13,11 +112,58 @@ typedef struct Cards
     int ranks;
 } Cards;
 
-typedef struct arg_struct
+// One cache line per worker: the counters are written only by the owner
+// and read by the main thread, so workers never share a line
+typedef struct worker
+{
+    pthread_t thread;
+    const Cards *cards_arr;
+    int id;
+    int cpu; // -1 - not pinned
+    atomic_ullong successes;
+    atomic_ullong trials;
+    atomic_ullong chunks;
+    atomic_ullong sum_k2;
+    atomic_ullong sum_nk;
+    atomic_ullong sum_n2;
+
+    // --perf: counters of this thread summed over all of its chunks
+    int perf_fd[PERF_COUNTERS]; // group, perf_fd[0] is the leader; -1 - not open
+    bool perf_ok;               // the counters were opened and read
+    uint64_t perf_values[PERF_COUNTERS];
+    uint64_t perf_trials;
+    double busy_time; // seconds inside run_chunk
+    double cpu_time;  // thread cpu time, seconds
+
+    void *kernel_state; // --kernel: per-thread state of the plugin
+} __attribute__((aligned(CACHE_LINE))) worker_t;
+
+worker_t *workers;
+int max_count_treads;
+bool perf_enabled = false;
+
+// --kernel: experiment plugin, NULL - the built-in card experiment
+static kernel_thread_init_f *kernel_thread_init;
+static kernel_run_f *kernel_run;
+static kernel_merge_f *kernel_merge;
+static kernel_report_f *kernel_report;
+static kernel_thread_destroy_f *kernel_thread_destroy;
+static kernel_save_f *kernel_save;
+static kernel_load_f *kernel_load;
+static void *kernel_library;
+static void *resumed_kernel_state; // --resume: plugin state of the trials in job.resumed
+
+static const struct
 {
-    Cards *cards_arr;
-    int count_tests;
-} arg_t;
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} perf_events[PERF_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+};
 
 void print(const char *text)
 {
@@ -28,26 +174,682 @@ void print(const char *text)
         exit(EXIT_FAILURE);
 }
 
-void *check_probability(void *__args)
+// plain sampling is binomial, the other modes need the batch-means variance
+void job_interval(const job_t *job, const tally_t *tally, double *low, double *high)
 {
-    arg_t *args = (arg_t *)__args;
+    tally_interval(tally, job->sampling != SAMPLING_PLAIN, job->z_score, low, high);
+}
+
+bool precision_reached(const job_t *job, const tally_t *tally)
+{
+    double low, high;
+    if (job->precision <= 0 || tally->trials == 0)
+        return false;
+    job_interval(job, tally, &low, &high);
+    return (high - low) / 2 <= job->precision;
+}
+
+static inline bool is_success(const Cards *cards_arr, event_t event, int idx_1, int idx_2)
+{
+    return event == EVENT_SUIT ? cards_arr[idx_1].suit == cards_arr[idx_2].suit
+                               : cards_arr[idx_1].ranks == cards_arr[idx_2].ranks;
+}
+
+// Built-in card experiment. Every chunk has its own random stream, so the
+// result depends only on the seed, not on the number of threads or on
+// which thread took the chunk
+int run_cards_chunk(const Cards *cards_arr, const job_t *job, uint64_t chunk, int count_tests)
+{
+    uint64_t state = kernel_stream(job->seed, chunk);
     int count_succes = 0;
-    int idx_1, idx_2;
-    srand((unsigned)time(NULL));
-    for (int i = 0; i < args->count_tests; ++i)
+    switch (job->sampling)
+    {
+    case SAMPLING_PLAIN:
+        for (int i = 0; i < count_tests; ++i)
+        {
+            uint64_t r = kernel_random(&state);
+            int idx_1 = kernel_bounded((uint32_t)r, 52);
+            int idx_2 = (idx_1 + 1 + kernel_bounded((uint32_t)(r >> 32), 51)) % 52;
+            count_succes += is_success(cards_arr, job->event, idx_1, idx_2);
+        }
+        break;
+
+    case SAMPLING_STRATIFIED:
+    {
+        // chunks start at multiples of 52, so every first card gets the same share;
+        // one 64-bit draw serves two trials
+        uint64_t r = 0;
+        for (int i = 0; i < count_tests; ++i)
+        {
+            if (!(i & 1))
+                r = kernel_random(&state);
+            int idx_1 = i % 52;
+            int idx_2 = (idx_1 + 1 + kernel_bounded((i & 1) ? (uint32_t)(r >> 32) : (uint32_t)r, 51)) % 52;
+            count_succes += is_success(cards_arr, job->event, idx_1, idx_2);
+        }
+        break;
+    }
+
+    case SAMPLING_ANTITHETIC:
+        // The partner keeps the first card and moves the second one 25
+        // places further round the other 51 cards. In this deck a card of
+        // the same rank is at most 3 places away and one of the same suit
+        // a multiple of 4 away, and no offset and its partner's are both
+        // like that, so a success never has a successful partner
+        for (int i = 0; i < count_tests; i += 2)
+        {
+            uint64_t r = kernel_random(&state);
+            int idx_1 = kernel_bounded((uint32_t)r, 52);
+            int offset = kernel_bounded((uint32_t)(r >> 32), 51);
+            count_succes += is_success(cards_arr, job->event, idx_1, (idx_1 + 1 + offset) % 52);
+            if (i + 1 < count_tests)
+                count_succes += is_success(cards_arr, job->event, idx_1, (idx_1 + 1 + (offset + 25) % 51) % 52);
+        }
+        break;
+
+    case SAMPLING_SHUFFLE:
+    {
+        int deck[52];
+        for (int i = 0; i < 52; ++i)
+            deck[i] = i;
+        for (int i = 0; i < count_tests; i += 26)
+        {
+            // Fisher-Yates, two bounded numbers per 64-bit draw
+            uint64_t r = 0;
+            for (int j = 51; j > 0; --j)
+            {
+                if (j & 1)
+                    r = kernel_random(&state);
+                int k = kernel_bounded((j & 1) ? (uint32_t)r : (uint32_t)(r >> 32), j + 1);
+                int temp = deck[j];
+                deck[j] = deck[k];
+                deck[k] = temp;
+            }
+            for (int pair = 0; pair < 26 && i + pair < count_tests; ++pair)
+                count_succes += is_success(cards_arr, job->event, deck[2 * pair], deck[2 * pair + 1]);
+        }
+        break;
+    }
+    }
+    return count_succes;
+}
+
+double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// opens a counter group for the calling thread, user space only so that it
+// works with the default perf_event_paranoid; leaves -1 in perf_fd on failure
+void perf_open(worker_t *worker)
+{
+    worker->perf_ok = false;
+    for (int i = 0; i < PERF_COUNTERS; ++i)
+        worker->perf_fd[i] = -1;
+
+    for (int i = 0; i < PERF_COUNTERS; ++i)
     {
-        idx_1 = rand() % 52;
-        do
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = (i == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, worker->perf_fd[0], 0);
+        if (fd == -1)
         {
-            idx_2 = rand() % 52;
-        } while (idx_2 == idx_1);
-        if (args->cards_arr[idx_1].suit == args->cards_arr[idx_2].suit)
-            count_succes++;
+            for (int j = 0; j < i; ++j)
+            {
+                close(worker->perf_fd[j]);
+                worker->perf_fd[j] = -1;
+            }
+            return;
+        }
+        worker->perf_fd[i] = fd;
+    }
+    worker->perf_ok = true;
+}
+
+void perf_close(worker_t *worker)
+{
+    struct timespec cpu;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    worker->cpu_time = cpu.tv_sec + cpu.tv_nsec / 1e9;
+
+    if (worker->perf_fd[0] == -1)
+        return;
+
+    uint64_t group[1 + PERF_COUNTERS];
+    if (read(worker->perf_fd[0], group, sizeof(group)) == sizeof(group))
+    {
+        for (int i = 0; i < PERF_COUNTERS; ++i)
+            worker->perf_values[i] = group[1 + i];
+    }
+    else
+        worker->perf_ok = false;
+
+    for (int i = 0; i < PERF_COUNTERS; ++i)
+    {
+        close(worker->perf_fd[i]);
+        worker->perf_fd[i] = -1;
+    }
+}
+
+// sums the per-worker slots, successes come from where reduce_mode puts them
+void collect(tally_t *tally)
+{
+    memset(tally, 0, sizeof(*tally));
+    for (int i = 0; i < max_count_treads; ++i)
+    {
+        tally->successes += atomic_load_explicit(&workers[i].successes, memory_order_relaxed);
+        tally->trials += atomic_load_explicit(&workers[i].trials, memory_order_relaxed);
+        tally->chunks += atomic_load_explicit(&workers[i].chunks, memory_order_relaxed);
+        tally->sum_k2 += atomic_load_explicit(&workers[i].sum_k2, memory_order_relaxed);
+        tally->sum_nk += atomic_load_explicit(&workers[i].sum_nk, memory_order_relaxed);
+        tally->sum_n2 += atomic_load_explicit(&workers[i].sum_n2, memory_order_relaxed);
+    }
+    if (reduce_mode == REDUCE_ATOMIC)
+        tally->successes = atomic_load(&success_events);
+    else if (reduce_mode == REDUCE_MUTEX)
+    {
+        pthread_mutex_lock(&success_mutex);
+        tally->successes = locked_success_events;
+        pthread_mutex_unlock(&success_mutex);
+    }
+    tally_add(tally, &job.resumed);
+}
+
+// one chunk starting at trial first, on the plugin or on the built-in kernel
+int run_chunk(worker_t *worker, const job_t *job, uint64_t first, int count_tests)
+{
+    if (!kernel_run)
+        return run_cards_chunk(worker->cards_arr, job, first / CHUNK_SIZE, count_tests);
+
+    uint64_t rng = kernel_stream(job->seed, first / CHUNK_SIZE);
+    return (int)kernel_run(worker->kernel_state, &rng, first, count_tests);
+}
+
+// parks the worker until the checkpoint is written
+void wait_checkpoint(void)
+{
+    pthread_mutex_lock(&workers_mutex);
+    paused_workers++;
+    pthread_cond_signal(&workers_done);
+    while (atomic_load(&pause_tests))
+        pthread_cond_wait(&job_resumed, &workers_mutex);
+    paused_workers--;
+    pthread_mutex_unlock(&workers_mutex);
+}
+
+void run_job(worker_t *worker, const job_t *job)
+{
+    tally_t local = {0};
+    while (!atomic_load_explicit(&stop_tests, memory_order_relaxed))
+    {
+        if (atomic_load_explicit(&pause_tests, memory_order_relaxed))
+            wait_checkpoint();
+        uint64_t first = atomic_fetch_add(&next_test, CHUNK_SIZE);
+        uint64_t end = job->first_test + job->count_rounds;
+        if (first >= end)
+            break;
+        int count_tests = (end - first < CHUNK_SIZE) ? (int)(end - first) : CHUNK_SIZE;
+
+        int count_succes;
+        if (perf_enabled)
+        {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (worker->perf_fd[0] != -1)
+                ioctl(worker->perf_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            count_succes = run_chunk(worker, job, first, count_tests);
+            if (worker->perf_fd[0] != -1)
+                ioctl(worker->perf_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            worker->busy_time += elapsed_since(&start);
+            worker->perf_trials += count_tests;
+        }
+        else
+            count_succes = run_chunk(worker, job, first, count_tests);
+        switch (reduce_mode)
+        {
+        case REDUCE_LOCAL:
+            local.successes += count_succes;
+            atomic_store_explicit(&worker->successes, local.successes, memory_order_relaxed);
+            break;
+        case REDUCE_ATOMIC:
+            atomic_fetch_add(&success_events, count_succes);
+            break;
+        case REDUCE_MUTEX:
+            if (pthread_mutex_lock(&success_mutex))
+            {
+                print("Pthread_mutex_lock error\n");
+                exit(EXIT_FAILURE);
+            }
+            locked_success_events += count_succes;
+            if (pthread_mutex_unlock(&success_mutex))
+            {
+                print("Pthread_mutex_unlock error\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        local.trials += count_tests;
+        local.chunks++;
+        local.sum_k2 += (uint64_t)count_succes * count_succes;
+        local.sum_nk += (uint64_t)count_tests * count_succes;
+        local.sum_n2 += (uint64_t)count_tests * count_tests;
+        atomic_store_explicit(&worker->trials, local.trials, memory_order_relaxed);
+        atomic_store_explicit(&worker->chunks, local.chunks, memory_order_relaxed);
+        atomic_store_explicit(&worker->sum_k2, local.sum_k2, memory_order_relaxed);
+        atomic_store_explicit(&worker->sum_nk, local.sum_nk, memory_order_relaxed);
+        atomic_store_explicit(&worker->sum_n2, local.sum_n2, memory_order_relaxed);
+        // checks the interval right away instead of waiting for the monitor's
+        // next tick; reading the other slots once per chunk is cheap
+        if (job->precision > 0)
+        {
+            tally_t all;
+            collect(&all);
+            if (precision_reached(job, &all))
+                atomic_store(&stop_tests, true);
+        }
+    }
+}
+
+// worker thread: stays alive between jobs so queries do not pay for
+// pthread_create/pthread_join
+void *check_probability(void *__args)
+{
+    worker_t *worker = (worker_t *)__args;
+    unsigned generation = 0;
+
+    if (perf_enabled)
+        perf_open(worker);
+    if (kernel_thread_init && !(worker->kernel_state = kernel_thread_init(worker->id)))
+    {
+        print("Kernel_thread_init error\n");
+        exit(EXIT_FAILURE);
     }
-    atomic_fetch_add(&success_events, count_succes);
+
+    pthread_mutex_lock(&workers_mutex);
+    while (true)
+    {
+        while (job_generation == generation && !pool_shutdown)
+            pthread_cond_wait(&job_started, &workers_mutex);
+        if (pool_shutdown)
+            break;
+        generation = job_generation;
+        pthread_mutex_unlock(&workers_mutex);
+
+        run_job(worker, &job);
+
+        pthread_mutex_lock(&workers_mutex);
+        if (--running_workers == paused_workers)
+            pthread_cond_signal(&workers_done);
+    }
+    pthread_mutex_unlock(&workers_mutex);
+
+    if (perf_enabled)
+        perf_close(worker);
     return NULL;
 }
 
+// --kernel: merges the plugin states of all workers and the resumed one
+// into part, so merge and --resume can report the plugin over all trials;
+// called while the workers are parked or idle
+void save_kernel_state(partial_t *part)
+{
+    part->kernel_size = 0;
+    if (!kernel_save)
+        return;
+    void *state = kernel_thread_init(max_count_treads);
+    if (!state)
+    {
+        print("Kernel_thread_init error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (resumed_kernel_state)
+        kernel_merge(state, resumed_kernel_state);
+    for (int i = 0; i < max_count_treads; ++i)
+        kernel_merge(state, workers[i].kernel_state);
+    part->kernel_size = kernel_save(state, part->kernel_state, sizeof(part->kernel_state));
+    kernel_thread_destroy(state);
+    if (!part->kernel_size)
+    {
+        print("Error. The kernel state does not fit into the partial file\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void save_checkpoint(void)
+{
+    save_kernel_state(&checkpoint);
+    if (partial_write(checkpoint_path, &checkpoint))
+    {
+        print("Error. Failed to write the checkpoint file\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// every claimed chunk is finished once all running workers are parked,
+// so the tally covers trials [first_test, first_test + trials);
+// called with workers_mutex held
+void write_checkpoint(void)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    atomic_store(&pause_tests, true);
+    while (paused_workers < running_workers)
+        pthread_cond_wait(&workers_done, &workers_mutex);
+    collect(&checkpoint.tally);
+    save_checkpoint();
+    atomic_store(&pause_tests, false);
+    pthread_cond_broadcast(&job_resumed);
+
+    count_checkpoints++;
+    checkpoint_time += elapsed_since(&start);
+}
+
+// waits for the workers, checking the stop conditions, writing checkpoints
+// and printing live progress to a terminal stderr; called with workers_mutex held
+void wait_workers(bool show_progress)
+{
+    struct timespec deadline, start;
+    int ticks = 0;
+    double last_checkpoint = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (running_workers > 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += MONITOR_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&workers_done, &workers_mutex, &deadline);
+        if (running_workers == 0)
+            break;
+
+        tally_t tally;
+        double elapsed = elapsed_since(&start);
+        collect(&tally);
+        if (precision_reached(&job, &tally) || (job.time_budget > 0 && elapsed >= job.time_budget))
+            atomic_store(&stop_tests, true);
+
+        // a slow disk stretches the interval, keeping the overhead bounded
+        if (checkpoint_path && elapsed - last_checkpoint >= checkpoint_interval &&
+            checkpoint_time <= elapsed * CHECKPOINT_OVERHEAD)
+        {
+            write_checkpoint();
+            last_checkpoint = elapsed_since(&start);
+        }
+
+        if (show_progress && ++ticks % (PROGRESS_INTERVAL_MS / MONITOR_INTERVAL_MS) == 0)
+        {
+            char msg[128];
+            double done = (double)tally.trials / job.count_rounds;
+            if (job.time_budget > 0 && elapsed / job.time_budget > done)
+                done = elapsed / job.time_budget;
+            int length = snprintf(msg, sizeof(msg), "\rprogress: %5.1lf%%  estimate: %.3lf%%  ",
+                                  done * 100, tally.trials ? (double)tally.successes / tally.trials * 100 : 0.);
+            write(STDERR_FILENO, msg, length);
+        }
+    }
+    if (show_progress)
+        write(STDERR_FILENO, "\r\033[K", 4);
+}
+
+void start_pool(const Cards *cards_arr, const int *cpus, int count_cpus)
+{
+    workers = aligned_alloc(CACHE_LINE, max_count_treads * sizeof(worker_t));
+    if (!workers)
+    {
+        print("Malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < max_count_treads; ++i)
+    {
+        pthread_attr_t attr;
+        workers[i].cards_arr = cards_arr;
+        workers[i].id = i;
+        workers[i].cpu = count_cpus ? cpus[i % count_cpus] : -1;
+        atomic_init(&workers[i].successes, 0);
+        atomic_init(&workers[i].trials, 0);
+        atomic_init(&workers[i].chunks, 0);
+        atomic_init(&workers[i].sum_k2, 0);
+        atomic_init(&workers[i].sum_nk, 0);
+        atomic_init(&workers[i].sum_n2, 0);
+        memset(workers[i].perf_values, 0, sizeof(workers[i].perf_values));
+        workers[i].perf_trials = 0;
+        workers[i].busy_time = workers[i].cpu_time = 0;
+        workers[i].kernel_state = NULL;
+
+        pthread_attr_init(&attr);
+        if (workers[i].cpu != -1)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(workers[i].cpu, &set);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set))
+            {
+                print("Pthread_attr_setaffinity_np error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (pthread_create(&workers[i].thread, &attr, check_probability, (void *)(&workers[i])))
+        {
+            print("Pthread_create error\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// per-thread --perf table on stderr, so stdout keeps only the result
+void print_perf_table(void)
+{
+    bool hardware = true;
+    char line[256];
+    int length;
+    uint64_t total[PERF_COUNTERS] = {0}, total_trials = 0;
+    double total_busy = 0, total_cpu = 0;
+
+    for (int i = 0; i < max_count_treads; ++i)
+        hardware = hardware && workers[i].perf_ok;
+
+    if (hardware)
+        length = snprintf(line, sizeof(line), "%6s %4s %14s %14s %14s %6s %14s %14s %10s %10s\n", "thread", "cpu",
+                          "trials", "cycles", "instructions", "IPC", "branch-misses", "cache-misses", "busy,ms", "cpu,ms");
+    else
+        length = snprintf(line, sizeof(line), "hardware counters unavailable, wall and cpu time only\n"
+                                              "%6s %4s %14s %10s %10s\n",
+                          "thread", "cpu", "trials", "busy,ms", "cpu,ms");
+    write(STDERR_FILENO, line, length);
+
+    for (int i = 0; i <= max_count_treads; ++i)
+    {
+        const uint64_t *values = total;
+        uint64_t trials = total_trials;
+        double busy = total_busy, cpu = total_cpu;
+        char id[16] = "total", cpu_id[16] = "-";
+        if (i < max_count_treads)
+        {
+            values = workers[i].perf_values;
+            trials = workers[i].perf_trials;
+            busy = workers[i].busy_time;
+            cpu = workers[i].cpu_time;
+            snprintf(id, sizeof(id), "%d", i);
+            if (workers[i].cpu != -1)
+                snprintf(cpu_id, sizeof(cpu_id), "%d", workers[i].cpu);
+
+            for (int j = 0; j < PERF_COUNTERS; ++j)
+                total[j] += values[j];
+            total_trials += trials;
+            total_busy += busy;
+            total_cpu += cpu;
+        }
+
+        if (hardware)
+            length = snprintf(line, sizeof(line), "%6s %4s %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %6.2lf %14" PRIu64 " %14" PRIu64 " %10.1lf %10.1lf\n",
+                              id, cpu_id, trials, values[0], values[1], values[0] ? (double)values[1] / values[0] : 0.,
+                              values[2], values[3], busy * 1e3, cpu * 1e3);
+        else
+            length = snprintf(line, sizeof(line), "%6s %4s %14" PRIu64 " %10.1lf %10.1lf\n",
+                              id, cpu_id, trials, busy * 1e3, cpu * 1e3);
+        write(STDERR_FILENO, line, length);
+    }
+}
+
+// the plugin report is skipped for an interrupted run, it continues later
+void stop_pool(bool report)
+{
+    pthread_mutex_lock(&workers_mutex);
+    pool_shutdown = true;
+    pthread_cond_broadcast(&job_started);
+    pthread_mutex_unlock(&workers_mutex);
+
+    for (int i = 0; i < max_count_treads; ++i)
+    {
+        if (pthread_join(workers[i].thread, NULL))
+        {
+            print("Pthread_join error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (kernel_thread_init)
+    {
+        if (resumed_kernel_state)
+        {
+            kernel_merge(workers[0].kernel_state, resumed_kernel_state);
+            kernel_thread_destroy(resumed_kernel_state);
+        }
+        for (int i = 1; i < max_count_treads; ++i)
+        {
+            kernel_merge(workers[0].kernel_state, workers[i].kernel_state);
+            kernel_thread_destroy(workers[i].kernel_state);
+        }
+        if (kernel_report && report)
+        {
+            char text[1024] = "";
+            kernel_report(workers[0].kernel_state, text, sizeof(text));
+            print(text);
+        }
+        kernel_thread_destroy(workers[0].kernel_state);
+    }
+    if (perf_enabled)
+        print_perf_table();
+    free(workers);
+}
+
+// runs one job on the pool and reduces its result
+void run_on_pool(const job_t *new_job, bool show_progress, tally_t *tally)
+{
+    pthread_mutex_lock(&workers_mutex);
+    job = *new_job;
+    atomic_store(&next_test, job.first_test + job.resumed.trials);
+    atomic_store(&stop_tests, false);
+    atomic_store(&success_events, 0);
+    locked_success_events = 0;
+    for (int i = 0; i < max_count_treads; ++i)
+    {
+        atomic_store_explicit(&workers[i].successes, 0, memory_order_relaxed);
+        atomic_store_explicit(&workers[i].trials, 0, memory_order_relaxed);
+        atomic_store_explicit(&workers[i].chunks, 0, memory_order_relaxed);
+        atomic_store_explicit(&workers[i].sum_k2, 0, memory_order_relaxed);
+        atomic_store_explicit(&workers[i].sum_nk, 0, memory_order_relaxed);
+        atomic_store_explicit(&workers[i].sum_n2, 0, memory_order_relaxed);
+    }
+    running_workers = max_count_treads;
+    job_generation++;
+    pthread_cond_broadcast(&job_started);
+
+    wait_workers(show_progress);
+    pthread_mutex_unlock(&workers_mutex);
+    collect(tally);
+}
+
+// accepts durations like "30s", "500ms", "2m", "1h"; plain numbers are seconds
+double parse_duration(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0)
+        return -1;
+    if (!strcmp(end, "ms"))
+        return value / 1e3;
+    if (!strcmp(end, "s") || *end == '\0')
+        return value;
+    if (!strcmp(end, "m"))
+        return value * 60;
+    if (!strcmp(end, "h"))
+        return value * 3600;
+    return -1;
+}
+
+int parse_event(const char *text, event_t *event)
+{
+    for (size_t i = 0; i < sizeof(event_names) / sizeof(event_names[0]); ++i)
+    {
+        if (!strcmp(text, event_names[i]))
+        {
+            *event = (event_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int parse_sampling(const char *text, sampling_t *sampling)
+{
+    for (size_t i = 0; i < sizeof(sampling_names) / sizeof(sampling_names[0]); ++i)
+    {
+        if (!strcmp(text, sampling_names[i]))
+        {
+            *sampling = (sampling_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// parses "i/N", 0 <= i < N
+int parse_shard(const char *text, int *shard, int *count_shards)
+{
+    char *end;
+    long i = strtol(text, &end, 10);
+    if (end == text || *end != '/')
+        return -1;
+    text = end + 1;
+    long n = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || n <= 0 || n > 1000000 || i < 0 || i >= n)
+        return -1;
+    *shard = (int)i;
+    *count_shards = (int)n;
+    return 0;
+}
+
+// strictly positive decimal number of trials below UNBOUNDED_ROUNDS, 0 on error
+uint64_t parse_count(const char *text)
+{
+    char *end;
+    if (*text < '0' || *text > '9')
+        return 0;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno || *end != '\0' || value >= UNBOUNDED_ROUNDS)
+        return 0;
+    return value;
+}
+
 void create_cards_arr(Cards *cards_arr)
 {
     int idx = 0;
@@ -64,54 +866,568 @@ void create_cards_arr(Cards *cards_arr)
     }
 }
 
+// parses a cpu list like "0,2,4-7", returns the number of cpus or -1
+int parse_cpus(const char *text, int *cpus, int max_cpus)
+{
+    int count = 0;
+    while (*text)
+    {
+        char *end;
+        long from = strtol(text, &end, 10), to = from;
+        if (end == text || from < 0)
+            return -1;
+        if (*end == '-')
+        {
+            text = end + 1;
+            to = strtol(text, &end, 10);
+            if (end == text || to < from)
+                return -1;
+        }
+        for (long cpu = from; cpu <= to; ++cpu)
+        {
+            if (count == max_cpus || cpu >= CPU_SETSIZE)
+                return -1;
+            cpus[count++] = (int)cpu;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        text = end;
+    }
+    return count ? count : -1;
+}
+
+// query line: space separated key=value pairs, e.g.
+// "id=7 event=rank sampling=shuffle trials=1000000 precision=0.01% confidence=99% seed=42 budget=1s"
+int parse_query(char *line, job_t *query, char *id, size_t id_size)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    *query = (job_t){.event = EVENT_SUIT, .count_rounds = UNBOUNDED_ROUNDS, .confidence = 0.95,
+                     .seed = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec};
+    id[0] = '\0';
+
+    for (char *token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n"))
+    {
+        char *value = strchr(token, '=');
+        if (!value)
+            return -1;
+        *value++ = '\0';
+        if (!strcmp(token, "id"))
+            snprintf(id, id_size, "%s", value);
+        else if (!strcmp(token, "event"))
+        {
+            if (parse_event(value, &query->event))
+                return -1;
+        }
+        else if (!strcmp(token, "sampling"))
+        {
+            if (parse_sampling(value, &query->sampling))
+                return -1;
+        }
+        else if (!strcmp(token, "trials"))
+        {
+            if (!(query->count_rounds = parse_count(value)))
+                return -1;
+        }
+        else if (!strcmp(token, "precision"))
+            query->precision = parse_fraction(value);
+        else if (!strcmp(token, "confidence"))
+            query->confidence = parse_fraction(value);
+        else if (!strcmp(token, "seed"))
+        {
+            char *end;
+            query->seed = strtoull(value, &end, 0);
+            if (end == value || *end != '\0')
+                return -1;
+        }
+        else if (!strcmp(token, "budget"))
+            query->time_budget = parse_duration(value);
+        else
+            return -1;
+    }
+    if (query->precision < 0 || query->confidence <= 0 || query->confidence >= 1 || query->time_budget < 0)
+        return -1;
+    if (query->count_rounds == UNBOUNDED_ROUNDS && query->precision <= 0 && query->time_budget <= 0)
+        return -1;
+    query->z_score = normal_quantile(1 - (1 - query->confidence) / 2);
+    return 0;
+}
+
+// reads queries line by line and streams back one result line per query
+// until EOF or a "quit" line; returns true on "quit"
+bool serve_stream(FILE *in, FILE *out)
+{
+    char *line = NULL;
+    size_t size = 0;
+    bool quit = false;
+
+    while (getline(&line, &size, in) != -1)
+    {
+        char id[64], prefix[80] = "";
+        job_t query;
+        struct timespec start;
+
+        if (!strcmp(line, "quit\n") || !strcmp(line, "quit"))
+        {
+            quit = true;
+            break;
+        }
+        if (strspn(line, " \t\r\n") == strlen(line))
+            continue;
+
+        if (parse_query(line, &query, id, sizeof(id)))
+        {
+            fprintf(out, "error=bad_query\n");
+            fflush(out);
+            continue;
+        }
+        if (id[0])
+            snprintf(prefix, sizeof(prefix), "id=%s ", id);
+
+        tally_t tally;
+        double low, high;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_on_pool(&query, false, &tally);
+        double elapsed = elapsed_since(&start);
+
+        job_interval(&query, &tally, &low, &high);
+        fprintf(out, "%sestimate=%.4lf%% trials=%" PRIu64 " ess=%.0lf low=%.4lf%% high=%.4lf%% confidence=%.2lf%% time_us=%.0lf\n",
+                prefix, (double)tally.successes / tally.trials * 100, tally.trials, tally_ess(&tally),
+                low * 100, high * 100, query.confidence * 100, elapsed * 1e6);
+        fflush(out);
+    }
+    free(line);
+    return quit;
+}
+
+// serves stdin/stdout, or clients of a UNIX socket one after another
+void serve(const char *socket_path)
+{
+    if (!socket_path)
+    {
+        serve_stream(stdin, stdout);
+        return;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        print("Input error. Socket path is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // a client that hangs up early must not kill the service
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 16) == -1)
+    {
+        print("Socket error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bool quit = false;
+    while (!quit)
+    {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            print("Accept error\n");
+            exit(EXIT_FAILURE);
+        }
+        FILE *in = fdopen(client, "r");
+        FILE *out = fdopen(dup(client), "w");
+        if (!in || !out)
+        {
+            print("Fdopen error\n");
+            exit(EXIT_FAILURE);
+        }
+        quit = serve_stream(in, out);
+        fclose(in);
+        fclose(out);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+}
+
+// --checkpoint: SIGTERM and SIGINT stop the run at a chunk boundary and
+// leave a checkpoint instead of throwing the trials away
+volatile sig_atomic_t interrupted = 0;
+
+void stop_on_signal(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+    atomic_store(&stop_tests, true);
+}
+
+// loads --kernel plugin, on any error stays with the built-in card experiment
+void load_kernel(const char *path)
+{
+    kernel_library = dlopen(path, RTLD_LOCAL | RTLD_NOW);
+    if (kernel_library)
+    {
+        kernel_thread_init = dlsym(kernel_library, "kernel_thread_init");
+        kernel_run = dlsym(kernel_library, "kernel_run");
+        kernel_merge = dlsym(kernel_library, "kernel_merge");
+        kernel_report = dlsym(kernel_library, "kernel_report");
+        kernel_thread_destroy = dlsym(kernel_library, "kernel_thread_destroy");
+        kernel_save = dlsym(kernel_library, "kernel_save");
+        kernel_load = dlsym(kernel_library, "kernel_load");
+        // one without the other is of no use
+        if (!kernel_save || !kernel_load)
+        {
+            kernel_save = NULL;
+            kernel_load = NULL;
+        }
+    }
+    if (!kernel_library || !kernel_thread_init || !kernel_run || !kernel_merge || !kernel_thread_destroy)
+    {
+        const char msg[] = "warning: failed to load the kernel, using the built-in card experiment\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        kernel_thread_init = NULL;
+        kernel_run = NULL;
+        kernel_merge = NULL;
+        kernel_report = NULL;
+        kernel_thread_destroy = NULL;
+        kernel_save = NULL;
+        kernel_load = NULL;
+        if (kernel_library)
+            dlclose(kernel_library);
+        kernel_library = NULL;
+    }
+}
+
 int main(int argc, char **argv)
 {
-    int max_count_treads, count_rounds, remainder;
-    if (argc != 3)
+    job_t cli_job = {.event = EVENT_SUIT, .confidence = 0.95};
+    int cpus[CPU_SETSIZE], count_cpus = 0;
+    int first_option = 3;
+    bool service = false;
+    const char *socket_path = NULL;
+    int shard = 0, count_shards = 0;
+    char partial_path[1024] = "";
+    bool seed_given = false, event_given = false, sampling_given = false, resume = false;
+    const char *kernel_path = NULL;
+    if (argc < 3)
     {
-        print("Input error. Enter <program_name><max_count_treads><count_rounds>\n");
+        print("Input error. Enter <program_name><max_count_treads>[count_rounds]"
+              "[--precision <half-width>][--confidence <level>][--time-budget <duration>]"
+              "[--event suit|rank][--sampling plain|stratified|antithetic|shuffle][--seed <n>][--shard <i>/<N>][--partial-file <path>]"
+              "[--cpus <list>][--reduce local|atomic|mutex][--serve [socket]][--perf][--kernel <plugin.so>]"
+              "[--checkpoint <path>][--checkpoint-interval <duration>][--resume]\n");
         exit(EXIT_FAILURE);
     }
     max_count_treads = atoi(argv[1]);
-    count_rounds = atoi(argv[2]);
-
-    pthread_t treads[max_count_treads];
-    Cards cards_arr[52];
-    create_cards_arr(cards_arr);
+    if (!strncmp(argv[2], "--", 2))
+    {
+        cli_job.count_rounds = UNBOUNDED_ROUNDS;
+        first_option = 2;
+    }
+    else if (!(cli_job.count_rounds = parse_count(argv[2])))
+    {
+        print("Input error. Round count must be a positive number below 2^32 * 65520\n");
+        exit(EXIT_FAILURE);
+    }
 
-    remainder = count_rounds % max_count_treads;
-    arg_t args = {.cards_arr = cards_arr, .count_tests = count_rounds / max_count_treads};
+    for (int i = first_option; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--precision") && i + 1 < argc)
+            cli_job.precision = parse_fraction(argv[++i]);
+        else if (!strcmp(argv[i], "--confidence") && i + 1 < argc)
+            cli_job.confidence = parse_fraction(argv[++i]);
+        else if (!strcmp(argv[i], "--time-budget") && i + 1 < argc)
+        {
+            if ((cli_job.time_budget = parse_duration(argv[++i])) < 0)
+            {
+                print("Input error. Time budget looks like 30s, 500ms, 2m or 1h\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (!strcmp(argv[i], "--event") && i + 1 < argc)
+        {
+            if (parse_event(argv[++i], &cli_job.event))
+            {
+                print("Input error. Event is suit or rank\n");
+                exit(EXIT_FAILURE);
+            }
+            event_given = true;
+        }
+        else if (!strcmp(argv[i], "--cpus") && i + 1 < argc)
+        {
+            if ((count_cpus = parse_cpus(argv[++i], cpus, CPU_SETSIZE)) == -1)
+            {
+                print("Input error. Cpu list looks like 0,2,4-7\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (!strcmp(argv[i], "--reduce") && i + 1 < argc)
+        {
+            ++i;
+            if (!strcmp(argv[i], "local"))
+                reduce_mode = REDUCE_LOCAL;
+            else if (!strcmp(argv[i], "atomic"))
+                reduce_mode = REDUCE_ATOMIC;
+            else if (!strcmp(argv[i], "mutex"))
+                reduce_mode = REDUCE_MUTEX;
+            else
+            {
+                print("Input error. Reduce mode is local, atomic or mutex\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (!strcmp(argv[i], "--sampling") && i + 1 < argc)
+        {
+            if (parse_sampling(argv[++i], &cli_job.sampling))
+            {
+                print("Input error. Sampling is plain, stratified, antithetic or shuffle\n");
+                exit(EXIT_FAILURE);
+            }
+            sampling_given = true;
+        }
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+        {
+            char *end;
+            ++i;
+            cli_job.seed = strtoull(argv[i], &end, 0);
+            if (end == argv[i] || *end != '\0')
+            {
+                print("Input error. Seed must be a number\n");
+                exit(EXIT_FAILURE);
+            }
+            seed_given = true;
+        }
+        else if (!strcmp(argv[i], "--shard") && i + 1 < argc)
+        {
+            if (parse_shard(argv[++i], &shard, &count_shards))
+            {
+                print("Input error. Shard looks like 0/4\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (!strcmp(argv[i], "--partial-file") && i + 1 < argc)
+            snprintf(partial_path, sizeof(partial_path), "%s", argv[++i]);
+        else if (!strcmp(argv[i], "--perf"))
+            perf_enabled = true;
+        else if (!strcmp(argv[i], "--kernel") && i + 1 < argc)
+            kernel_path = argv[++i];
+        else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc)
+            checkpoint_path = argv[++i];
+        else if (!strcmp(argv[i], "--checkpoint-interval") && i + 1 < argc)
+        {
+            if ((checkpoint_interval = parse_duration(argv[++i])) < 0)
+            {
+                print("Input error. Checkpoint interval looks like 30s, 500ms, 2m or 1h\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (!strcmp(argv[i], "--resume"))
+            resume = true;
+        else if (!strcmp(argv[i], "--serve"))
+        {
+            service = true;
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2))
+                socket_path = argv[++i];
+        }
+        else
+        {
+            print("Input error. Unknown option\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cli_job.precision < 0 || cli_job.confidence <= 0 || cli_job.confidence >= 1)
+    {
+        print("Input error. Precision and confidence are fractions like 0.0001 or 0.01%\n");
+        exit(EXIT_FAILURE);
+    }
+    if (max_count_treads <= 0)
+    {
+        print("Input error. Thread count must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!service && cli_job.count_rounds == UNBOUNDED_ROUNDS && cli_job.precision <= 0 && cli_job.time_budget <= 0)
+    {
+        print("Input error. Round count can be omitted only with --precision or --time-budget\n");
+        exit(EXIT_FAILURE);
+    }
+    if (kernel_path)
+    {
+        load_kernel(kernel_path);
+        // sampling modes and events are specific to the card experiment
+        if (kernel_run && (event_given || cli_job.sampling != SAMPLING_PLAIN))
+        {
+            print("Input error. --event and --sampling do not work with --kernel\n");
+            exit(EXIT_FAILURE);
+        }
+        // every shard, or every resumed part, would report only its own trials
+        if (kernel_report && !kernel_save && (count_shards || checkpoint_path))
+        {
+            print("Input error. --shard and --checkpoint need kernel_save and kernel_load in a kernel with kernel_report\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    cli_job.z_score = normal_quantile(1 - (1 - cli_job.confidence) / 2);
+    if (!seed_given)
+        cli_job.seed = (uint64_t)time(NULL);
 
-    if (remainder)
+    // a shard takes a chunk-aligned slice, so shards merged together give
+    // exactly the trials of one unsharded run with the same seed
+    uint64_t total_rounds = cli_job.count_rounds;
+    if (count_shards)
     {
-        args.count_tests += remainder;
-        if (pthread_create(&treads[0], NULL, check_probability, (void *)(&args)))
+        if (service || cli_job.count_rounds == UNBOUNDED_ROUNDS)
         {
-            print("Pthread_create error\n");
+            print("Input error. --shard needs a round count and does not work with --serve\n");
+            exit(EXIT_FAILURE);
+        }
+        uint64_t chunks = (total_rounds + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        uint64_t first_chunk = chunks * shard / count_shards;
+        uint64_t last_chunk = chunks * (shard + 1) / count_shards;
+        uint64_t end = last_chunk * CHUNK_SIZE < total_rounds ? last_chunk * CHUNK_SIZE : total_rounds;
+
+        cli_job.first_test = first_chunk * CHUNK_SIZE;
+        cli_job.count_rounds = end > cli_job.first_test ? end - cli_job.first_test : 0;
+        if (!partial_path[0])
+            snprintf(partial_path, sizeof(partial_path), "shard-%d-of-%d.part", shard, count_shards);
+        if (!cli_job.count_rounds)
+        {
+            print("Input error. The shard is empty, use fewer shards\n");
             exit(EXIT_FAILURE);
         }
-        args.count_tests -= remainder;
     }
 
-    for (int i = (remainder) ? 1 : 0; i < max_count_treads; ++i)
+    if ((checkpoint_path || resume) && (service || !checkpoint_path))
+    {
+        print("Input error. --resume needs --checkpoint, and both do not work with --serve\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // shard results and checkpoints share the partial file format
+    // an unsharded run is shard 0/1
+    partial_t part = {.seed = cli_job.seed, .shard = shard, .count_shards = count_shards ? count_shards : 1,
+                      .rounds = total_rounds, .first_test = cli_job.first_test, .slice = cli_job.count_rounds};
+    if (kernel_run)
+    {
+        const char *name = strrchr(kernel_path, '/');
+        snprintf(part.event, sizeof(part.event), "%s", name ? name + 1 : kernel_path);
+    }
+    else
+        snprintf(part.event, sizeof(part.event), "%s", event_names[cli_job.event]);
+    snprintf(part.sampling, sizeof(part.sampling), "%s", sampling_names[cli_job.sampling]);
+
+    if (resume && access(checkpoint_path, F_OK))
+    {
+        const char msg[] = "warning: no checkpoint yet, starting from scratch\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+    }
+    else if (resume)
     {
-        if (pthread_create(&treads[i], NULL, check_probability, (void *)(&args)))
+        partial_t saved;
+        if (partial_read(checkpoint_path, &saved))
         {
-            print("Pthread_create error\n");
+            print("Error. The checkpoint file is damaged\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!seed_given)
+            part.seed = cli_job.seed = saved.seed;
+        if (strcmp(saved.event, part.event) || strcmp(saved.sampling, part.sampling) || saved.seed != part.seed ||
+            saved.shard != part.shard || saved.count_shards != part.count_shards || saved.rounds != part.rounds ||
+            saved.first_test != part.first_test || saved.slice != part.slice)
+        {
+            print("Error. The checkpoint belongs to another run (event, sampling, seed, shard or rounds differ)\n");
             exit(EXIT_FAILURE);
         }
+        cli_job.resumed = saved.tally;
+        if (kernel_load && saved.tally.trials)
+        {
+            if (!(resumed_kernel_state = kernel_thread_init(max_count_treads)))
+            {
+                print("Kernel_thread_init error\n");
+                exit(EXIT_FAILURE);
+            }
+            if (!saved.kernel_size || kernel_load(resumed_kernel_state, saved.kernel_state, saved.kernel_size))
+            {
+                print("Error. The checkpoint holds no state of this kernel\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (checkpoint_path)
+    {
+        checkpoint = part;
+        signal(SIGTERM, stop_on_signal);
+        signal(SIGINT, stop_on_signal);
     }
 
-    for (int i = 0; i < max_count_treads; ++i)
+    Cards cards_arr[52];
+    create_cards_arr(cards_arr);
+    start_pool(cards_arr, cpus, count_cpus);
+
+    if (service)
+    {
+        serve(socket_path);
+        stop_pool(true);
+        return 0;
+    }
+
+    tally_t tally;
+    run_on_pool(&cli_job, isatty(STDERR_FILENO), &tally);
+
+    if (checkpoint_path)
     {
-        if (pthread_join(treads[i], NULL))
+        char msg[300];
+        checkpoint.tally = tally;
+        save_checkpoint();
+        int length = snprintf(msg, sizeof(msg), "checkpoints: %d, overhead %.3lf s\n",
+                              count_checkpoints + 1, checkpoint_time);
+        write(STDERR_FILENO, msg, length);
+        if (interrupted)
         {
-            print("Pthread_join error\n");
+            length = snprintf(msg, sizeof(msg), "interrupted after %" PRIu64 " trials, continue with --resume\n",
+                              tally.trials);
+            write(STDERR_FILENO, msg, length);
+            stop_pool(false);
             exit(EXIT_FAILURE);
         }
     }
-    char result[100];
-    sprintf(result, "%.3lf%%\n", (double)success_events / count_rounds * 100);
+
+    char result[300];
+    // an explicit --sampling asks for the effective sample size, plain included
+    if (cli_job.precision > 0 || cli_job.time_budget > 0 || sampling_given)
+    {
+        double low, high, ess = tally_ess(&tally);
+        job_interval(&cli_job, &tally, &low, &high);
+        sprintf(result, "%.3lf%%\ntrials: %" PRIu64 "\neffective sample size: %.0lf (%.2lf per trial)\n"
+                        "interval: [%.4lf%%, %.4lf%%] at %.2lf%% confidence%s\n",
+                (double)tally.successes / tally.trials * 100, tally.trials, ess, ess / tally.trials,
+                low * 100, high * 100, cli_job.confidence * 100,
+                (cli_job.precision <= 0 || precision_reached(&cli_job, &tally)) ? "" : " (precision not reached)");
+    }
+    else
+        sprintf(result, "%.3lf%%\n", (double)tally.successes / cli_job.count_rounds * 100);
     print(result);
+
+    if (count_shards)
+    {
+        part.tally = tally;
+        save_kernel_state(&part);
+        if (partial_write(partial_path, &part))
+        {
+            print("Error. Failed to write the partial result file\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(result, "partial: %.180s\n", partial_path);
+        print(result);
+    }
+    stop_pool(true);
+    if (kernel_library)
+        dlclose(kernel_library);
     return 0;
 }
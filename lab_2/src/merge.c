@@ -0,0 +1,177 @@
+#include <unistd.h>
+#include <stdbool.h>
+#include <dlfcn.h>
+
+#include "lib.h"
+
+void print(const char *text)
+{
+    if (!text)
+        return;
+
+    if (write(STDOUT_FILENO, text, strlen(text)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+// --kernel: the plugin the shards were run with, to report it over all of them
+static kernel_thread_init_f *kernel_thread_init;
+static kernel_merge_f *kernel_merge;
+static kernel_report_f *kernel_report;
+static kernel_thread_destroy_f *kernel_thread_destroy;
+static kernel_load_f *kernel_load;
+
+void load_kernel(const char *path)
+{
+    void *library = dlopen(path, RTLD_LOCAL | RTLD_NOW);
+    if (library)
+    {
+        kernel_thread_init = dlsym(library, "kernel_thread_init");
+        kernel_merge = dlsym(library, "kernel_merge");
+        kernel_report = dlsym(library, "kernel_report");
+        kernel_thread_destroy = dlsym(library, "kernel_thread_destroy");
+        kernel_load = dlsym(library, "kernel_load");
+    }
+    if (!kernel_thread_init || !kernel_merge || !kernel_report || !kernel_thread_destroy || !kernel_load)
+    {
+        const char msg[] = "error: failed to load a kernel with kernel_report and kernel_load\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void *new_kernel_state(void)
+{
+    void *state = kernel_thread_init(0);
+    if (!state)
+    {
+        print("Kernel_thread_init error\n");
+        exit(EXIT_FAILURE);
+    }
+    return state;
+}
+
+int main(int argc, char **argv)
+{
+    double confidence = 0.95;
+    const char *kernel_path = NULL;
+    int first_file = 1;
+    for (; first_file + 1 < argc; first_file += 2)
+    {
+        if (!strcmp(argv[first_file], "--confidence"))
+            confidence = parse_fraction(argv[first_file + 1]);
+        else if (!strcmp(argv[first_file], "--kernel"))
+            kernel_path = argv[first_file + 1];
+        else
+            break;
+    }
+    if (first_file >= argc || confidence <= 0 || confidence >= 1)
+    {
+        print("Input error. Enter <program_name>[--confidence <level>][--kernel <plugin.so>]<partial_file>...\n");
+        exit(EXIT_FAILURE);
+    }
+    void *kernel_state = NULL;
+    if (kernel_path)
+    {
+        load_kernel(kernel_path);
+        kernel_state = new_kernel_state();
+    }
+
+    partial_t first, part;
+    tally_t tally = {0};
+    bool *seen = NULL;
+    bool complete = true;
+    char msg[1200];
+
+    for (int i = first_file; i < argc; ++i)
+    {
+        if (partial_read(argv[i], &part))
+        {
+            snprintf(msg, sizeof(msg), "error: %s is not a partial result file\n", argv[i]);
+            write(STDERR_FILENO, msg, strlen(msg));
+            exit(EXIT_FAILURE);
+        }
+        if (i == first_file)
+        {
+            first = part;
+            seen = calloc(first.count_shards, sizeof(bool));
+            if (!seen)
+            {
+                print("Malloc error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(part.event, first.event) || strcmp(part.sampling, first.sampling) ||
+                 part.seed != first.seed || part.count_shards != first.count_shards || part.rounds != first.rounds)
+        {
+            snprintf(msg, sizeof(msg), "error: %s belongs to another run (event, sampling, seed, shard count or rounds differ)\n", argv[i]);
+            write(STDERR_FILENO, msg, strlen(msg));
+            exit(EXIT_FAILURE);
+        }
+        if (seen[part.shard])
+        {
+            snprintf(msg, sizeof(msg), "error: shard %d is given twice\n", part.shard);
+            write(STDERR_FILENO, msg, strlen(msg));
+            exit(EXIT_FAILURE);
+        }
+        seen[part.shard] = true;
+        tally_add(&tally, &part.tally);
+        if (kernel_state)
+        {
+            const char *name = strrchr(kernel_path, '/');
+            void *other = new_kernel_state();
+            if (strncmp(part.event, name ? name + 1 : kernel_path, sizeof(part.event) - 1) || !part.kernel_size ||
+                kernel_load(other, part.kernel_state, part.kernel_size))
+            {
+                snprintf(msg, sizeof(msg), "error: %s holds no state of this kernel\n", argv[i]);
+                write(STDERR_FILENO, msg, strlen(msg));
+                exit(EXIT_FAILURE);
+            }
+            kernel_merge(kernel_state, other);
+            kernel_thread_destroy(other);
+        }
+        else if (part.kernel_size && i == first_file)
+        {
+            snprintf(msg, sizeof(msg), "warning: the shards ran %s, give it with --kernel to merge its report\n", part.event);
+            write(STDERR_FILENO, msg, strlen(msg));
+        }
+        if (part.tally.trials < part.slice)
+        {
+            snprintf(msg, sizeof(msg), "warning: shard %d stopped after %" PRIu64 " of %" PRIu64 " trials\n",
+                     part.shard, part.tally.trials, part.slice);
+            write(STDERR_FILENO, msg, strlen(msg));
+            complete = false;
+        }
+    }
+    for (int i = 0; i < first.count_shards; ++i)
+    {
+        if (!seen[i])
+        {
+            snprintf(msg, sizeof(msg), "warning: shard %d/%d is missing\n", i, first.count_shards);
+            write(STDERR_FILENO, msg, strlen(msg));
+            complete = false;
+        }
+    }
+    free(seen);
+
+    if (!tally.trials)
+    {
+        print("Error. The partial files contain no trials\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double low, high, ess = tally_ess(&tally);
+    tally_interval(&tally, strcmp(first.sampling, "plain"), normal_quantile(1 - (1 - confidence) / 2), &low, &high);
+    snprintf(msg, sizeof(msg), "%.3lf%%\ntrials: %" PRIu64 " of %" PRIu64 "%s\neffective sample size: %.0lf (%.2lf per trial)\n"
+                               "interval: [%.4lf%%, %.4lf%%] at %.2lf%% confidence\n",
+             (double)tally.successes / tally.trials * 100, tally.trials, first.rounds, complete ? "" : " (incomplete)",
+             ess, ess / tally.trials, low * 100, high * 100, confidence * 100);
+    print(msg);
+    if (kernel_state)
+    {
+        char text[1024] = "";
+        kernel_report(kernel_state, text, sizeof(text));
+        print(text);
+        kernel_thread_destroy(kernel_state);
+    }
+    return 0;
+}
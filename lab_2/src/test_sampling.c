@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/wait.h>
+
+static char MAIN_PROGRAM_NAME[] = "main";
+
+#define COUNT_ROUNDS "100000000"
+#define SEED "7"
+
+void print(const char *text)
+{
+    if (!text)
+        return;
+
+    if (write(STDOUT_FILENO, text, strlen(text)) == -1)
+        exit(EXIT_FAILURE);
+}
+
+// runs main on one thread and returns the effective sample size per trial it reports
+double ess_per_trial(const char *path, const char *event, const char *sampling)
+{
+    int pipe_fd[2];
+    if (pipe(pipe_fd) == -1)
+    {
+        const char msg[] = "error: failed to create pipe\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    pid_t child = fork();
+    switch (child)
+    {
+    case -1:
+    {
+        const char msg[] = "error: failed to spawn new process\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    case 0:
+    {
+        if (dup2(pipe_fd[1], STDOUT_FILENO) == -1)
+            _exit(EXIT_FAILURE);
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+
+        char *const args[] = {MAIN_PROGRAM_NAME, "1", COUNT_ROUNDS, "--event", (char *)event,
+                              "--sampling", (char *)sampling, "--seed", SEED, NULL};
+        execv(path, args);
+        _exit(EXIT_FAILURE);
+    }
+    }
+    close(pipe_fd[1]);
+
+    char output[4096];
+    size_t length = 0;
+    ssize_t bytes;
+    while (length < sizeof(output) - 1 && (bytes = read(pipe_fd[0], output + length, sizeof(output) - 1 - length)) > 0)
+        length += bytes;
+    output[length] = '\0';
+    close(pipe_fd[0]);
+
+    int child_status;
+    if (waitpid(child, &child_status, 0) == -1 || !WIFEXITED(child_status) ||
+        WEXITSTATUS(child_status) != EXIT_SUCCESS)
+    {
+        const char msg[] = "error: main exited with error\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+
+    double ess, per_trial;
+    char *line = strstr(output, "effective sample size:");
+    if (!line || sscanf(line, "effective sample size: %lf (%lf per trial)", &ess, &per_trial) != 2)
+    {
+        const char msg[] = "error: main reported no effective sample size\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    return per_trial;
+}
+
+// Antithetic pairs must beat plain sampling on the same seed. Only the suit
+// event is checked: for the rarer same rank pairs can win at most 7%, which
+// the batch-means estimate does not resolve
+int main(void)
+{
+    char path[1024];
+    {
+        ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (len == -1)
+        {
+            const char msg[] = "error: failed to read full program path\n";
+            write(STDERR_FILENO, msg, sizeof(msg));
+            exit(EXIT_FAILURE);
+        }
+        while (path[len] != '/')
+            --len;
+        path[len] = '\0';
+        strncat(path, "/", sizeof(path) - strlen(path) - 1);
+        strncat(path, MAIN_PROGRAM_NAME, sizeof(path) - strlen(path) - 1);
+    }
+
+    double plain = ess_per_trial(path, "suit", "plain");
+    double antithetic = ess_per_trial(path, "suit", "antithetic");
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "effective sample size per trial: plain %.2lf, antithetic %.2lf - %s\n", plain,
+             antithetic, antithetic > plain ? "OK" : "BAD");
+    print(msg);
+    return antithetic > plain ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,214 @@
+#ifndef __BROADCAST_H
+#define __BROADCAST_H
+
+#include <limits.h>
+
+#include "ring.h"
+
+#define BROADCAST_READERS 64
+#define BROADCAST_SPIN 1024
+
+// One producer, every reader sees every message. The slots and the data
+// area are the ones of ring_t, but each reader has its own cursor on its
+// own cache line, and the producer reuses space only once the slowest
+// reader released it, so readers cost no memory and no copies on the
+// producer side. The producer remembers the slowest cursor and looks at
+// the others again only when that is not enough. Readers sleep on the
+// head itself, the producer on its waiting flag, both futexes.
+
+typedef struct reader_t
+{
+    _Alignas(CACHE_LINE) atomic_uint tail; // slots released
+    _Atomic uint64_t data_tail;
+    unsigned taken; // this reader only
+    int spin;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t producer_wakeups;
+} reader_t;
+
+typedef struct broadcast_t
+{
+    // written by the producer
+    _Alignas(CACHE_LINE) atomic_uint head; // slots published
+    atomic_int producer_waiting;
+    uint64_t data_head; // producer only
+    uint64_t slowest_data_tail;
+    unsigned slowest_tail;
+    int producer_spin;
+    _Atomic uint64_t messages, bytes;
+    _Atomic uint64_t high_water; // bytes in flight for the slowest reader at most
+    _Atomic uint64_t producer_wait_ns;
+    _Atomic uint64_t consumer_wakeups;
+
+    _Alignas(CACHE_LINE) atomic_int readers_waiting;
+    uint32_t count_readers;
+    reader_t readers[BROADCAST_READERS];
+    slot_t slots[RING_SLOTS];
+    _Alignas(CACHE_LINE) char data[RING_DATA];
+} broadcast_t;
+
+static inline void broadcast_init(broadcast_t *channel, uint32_t count_readers)
+{
+    int spin = ring_spin_budget(BROADCAST_SPIN);
+    atomic_init(&channel->head, 0);
+    atomic_init(&channel->producer_waiting, 0);
+    channel->data_head = channel->slowest_data_tail = 0;
+    channel->slowest_tail = 0;
+    channel->producer_spin = spin;
+    atomic_init(&channel->messages, 0);
+    atomic_init(&channel->bytes, 0);
+    atomic_init(&channel->high_water, 0);
+    atomic_init(&channel->producer_wait_ns, 0);
+    atomic_init(&channel->consumer_wakeups, 0);
+    atomic_init(&channel->readers_waiting, 0);
+    channel->count_readers = count_readers;
+    for (uint32_t i = 0; i < count_readers; ++i)
+    {
+        reader_t *reader = &channel->readers[i];
+        atomic_init(&reader->tail, 0);
+        atomic_init(&reader->data_tail, 0);
+        reader->taken = 0;
+        reader->spin = spin;
+        atomic_init(&reader->wait_ns, 0);
+        atomic_init(&reader->producer_wakeups, 0);
+    }
+}
+
+// finds the slowest reader again
+static inline void broadcast_slowest(broadcast_t *channel)
+{
+    unsigned head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    unsigned tail = head;
+    uint64_t data_tail = channel->data_head;
+    for (uint32_t i = 0; i < channel->count_readers; ++i)
+    {
+        uint64_t reader_data_tail;
+        unsigned reader_tail = ring_load_tail(&channel->readers[i].tail, &channel->readers[i].data_tail, &reader_data_tail);
+        if (head - reader_tail > head - tail)
+            tail = reader_tail;
+        if (reader_data_tail < data_tail)
+            data_tail = reader_data_tail;
+    }
+    channel->slowest_tail = tail;
+    channel->slowest_data_tail = data_tail;
+}
+
+static inline bool broadcast_fits(broadcast_t *channel, uint64_t end)
+{
+    unsigned head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    if (end - channel->slowest_data_tail <= RING_DATA && head - channel->slowest_tail < RING_SLOTS)
+        return true;
+    broadcast_slowest(channel);
+    return end - channel->slowest_data_tail <= RING_DATA && head - channel->slowest_tail < RING_SLOTS;
+}
+
+// waits until the slowest reader freed the data area up to end and a slot
+static inline void broadcast_wait_space(broadcast_t *channel, uint64_t end)
+{
+    if (broadcast_fits(channel, end))
+        return;
+    uint64_t start = ring_now();
+    for (int i = 0; i < channel->producer_spin && !broadcast_fits(channel, end); ++i)
+        ring_relax();
+    while (!broadcast_fits(channel, end))
+    {
+        // a reader that releases after the flag is up clears it and wakes us
+        atomic_store(&channel->producer_waiting, 1);
+        if (broadcast_fits(channel, end))
+            atomic_store(&channel->producer_waiting, 0);
+        while (atomic_load(&channel->producer_waiting))
+            syscall(SYS_futex, &channel->producer_waiting, FUTEX_WAIT, 1, NULL, NULL, 0);
+    }
+    ring_count(&channel->producer_wait_ns, ring_now() - start);
+}
+
+// the free space is the one the slowest reader left, see ring_reserve()
+static inline char *broadcast_reserve(broadcast_t *channel, uint32_t size, uint32_t *available)
+{
+    uint64_t position = ring_place(channel->data_head, size);
+    broadcast_slowest(channel);
+    broadcast_wait_space(channel, position + size);
+    channel->data_head = position;
+    if (available)
+        *available = ring_available(position, channel->slowest_data_tail);
+    return channel->data + position % RING_DATA;
+}
+
+// see ring_commit(); every sleeping reader is woken
+static inline void broadcast_commit(broadcast_t *channel, const char *data, uint32_t length, uint32_t flags)
+{
+    uint64_t position = ring_position(channel->data, channel->data_head, data);
+    broadcast_wait_space(channel, position + length);
+
+    unsigned head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    ring_fill(channel->slots, head, position, length, flags);
+    channel->data_head = position + length;
+    atomic_store(&channel->head, head + 1);
+    if (atomic_load(&channel->readers_waiting))
+    {
+        syscall(SYS_futex, &channel->head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        ring_count(&channel->consumer_wakeups, 1);
+    }
+
+    ring_count(&channel->messages, 1);
+    ring_count(&channel->bytes, length);
+    ring_high_water(&channel->high_water, channel->data_head - channel->slowest_data_tail);
+}
+
+static inline int broadcast_push(broadcast_t *channel, const void *data, uint32_t length, uint32_t flags)
+{
+    if (length > RING_MESSAGE)
+        return -1;
+    char *place = broadcast_reserve(channel, length, NULL);
+    if (length)
+        memcpy(place, data, length);
+    broadcast_commit(channel, place, length, flags);
+    return 0;
+}
+
+// next message for the reader, waits while there is none; the message is
+// shared with the other readers and must not be changed
+static inline const slot_t *broadcast_take(broadcast_t *channel, uint32_t index)
+{
+    reader_t *reader = &channel->readers[index];
+    unsigned taken = reader->taken;
+    if (atomic_load_explicit(&channel->head, memory_order_acquire) == taken)
+    {
+        uint64_t start = ring_now();
+        for (int i = 0; i < reader->spin && atomic_load_explicit(&channel->head, memory_order_acquire) == taken; ++i)
+            ring_relax();
+        while (atomic_load(&channel->head) == taken)
+        {
+            // the producer looks for sleepers after it moved the head
+            atomic_fetch_add(&channel->readers_waiting, 1);
+            if (atomic_load(&channel->head) == taken)
+                syscall(SYS_futex, &channel->head, FUTEX_WAIT, taken, NULL, NULL, 0);
+            atomic_fetch_sub(&channel->readers_waiting, 1);
+        }
+        ring_count(&reader->wait_ns, ring_now() - start);
+    }
+    reader->taken = taken + 1;
+    return &channel->slots[taken % RING_SLOTS];
+}
+
+static inline const char *broadcast_data(broadcast_t *channel, const slot_t *slot)
+{
+    return channel->data + slot->position % RING_DATA;
+}
+
+// gives every message the reader took back; the producer only gets the
+// space once every reader did
+static inline void broadcast_release(broadcast_t *channel, uint32_t index)
+{
+    reader_t *reader = &channel->readers[index];
+    const slot_t *last = &channel->slots[(reader->taken - 1) % RING_SLOTS];
+    atomic_store_explicit(&reader->data_tail, last->position + last->length, memory_order_relaxed);
+    atomic_store(&reader->tail, reader->taken);
+    if (atomic_load(&channel->producer_waiting) && atomic_exchange(&channel->producer_waiting, 0))
+    {
+        syscall(SYS_futex, &channel->producer_waiting, FUTEX_WAKE, 1, NULL, NULL, 0);
+        ring_count(&reader->producer_wakeups, 1);
+    }
+}
+
+#endif
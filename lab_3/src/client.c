@@ -1,10 +1,13 @@
 #include "lib.h"
 #include "string.h"
+#include "writer.h"
+#include <sys/uio.h>
 
-void str_reverse(char *str)
+#define MAX_PARTS 1024 // parts of one line kept in the ring, the last iovec is the newline
+
+void str_reverse(char *str, size_t len)
 {
-    int len = strlen(str);
-    for (int i = 0; i < len / 2; ++i)
+    for (size_t i = 0; i < len / 2; ++i)
     {
         char temp = str[i];
         str[i] = str[len - 1 - i];
@@ -12,93 +15,244 @@ void str_reverse(char *str)
     }
 }
 
-int main(int argc, char **argv)
+// appends to the heap copy of a line that was too long to keep in one piece
+void append(char **buf, size_t *size, size_t *bytes, const char *data, size_t length)
 {
-    char buf[BUFFER_SIZE];
-    ssize_t bytes;
-
-    pid_t pid = getpid();
-
-    // NOTE: `O_WRONLY` only enables file for writing
-    // NOTE: `O_CREAT` creates the requested file if absent
-    // NOTE: `O_TRUNC` empties the file prior to opening
-    // NOTE: `O_APPEND` subsequent writes are being appended instead of overwritten
-    int32_t file = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
-    if (file == -1)
+    if (*bytes + length > *size)
     {
-        const char msg[] = "error: failed to open requested file\n";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
+        *size = (*bytes + length > 2 * *size) ? *bytes + length : 2 * *size;
+        if (!(*buf = realloc(*buf, *size)))
+        {
+            const char msg[] = "error: client failed to allocate memory\n";
+            write(STDERR_FILENO, msg, sizeof(msg));
+            exit(EXIT_FAILURE);
+        }
     }
+    memcpy(*buf + *bytes, data, length);
+    *bytes += length;
+}
 
-    int shm_fd = shm_open(argv[4], O_RDONLY, 0666);
-    if (shm_fd == -1)
-    {
-        const char msg[] = "error: failed to open shared memory";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
-    }
-    char *shared_memory = mmap(0, BUFFER_SIZE, PROT_READ, MAP_SHARED, shm_fd, 0);
-    if (shared_memory == MAP_FAILED)
+// writes the lines of the urgent lane at once, ahead of any bulk line
+void drain_urgent(ring_t *ring, writer_t *writer)
+{
+    char line[RING_URGENT + 1];
+    const urgent_t *cell = ring_take_urgent(ring);
+    if (!cell)
+        return;
+    for (; cell; cell = ring_take_urgent(ring))
     {
-        const char msg[] = "error: failed to map shared memory";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
+        // clamped, so the copy stays inside line
+        uint32_t length = (cell->length < RING_URGENT) ? cell->length : RING_URGENT;
+        memcpy(line, cell->data, length);
+        str_reverse(line, length);
+        line[length] = '\n';
+        writer_copy(writer, line, length + 1);
+        ring_release_urgent(ring);
     }
+    writer_send(writer);
+}
 
-    sem_t *sem_write = sem_open(argv[2], 0);
-    sem_t *sem_read = sem_open(argv[3], 0);
-    if (sem_write == SEM_FAILED || sem_read == SEM_FAILED)
-    {
-        const char msg[] = "error: client failed to open semaphore";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
-    }
+// writes the lines of our own ring until the server is done
+void drain(ring_t *ring, writer_t *writer)
+{
+    char *buf = NULL;
+    size_t size = 0, bytes = 0;
+    struct iovec parts[MAX_PARTS];
+    int count_parts = 0;
+    size_t held = 0;
+    bool spilled = false;
 
     char flag = 1;
     do
     {
-        sem_wait(sem_read);
-        if (*shared_memory == '\n')
+        // waits only when the ring is empty, otherwise drains what is there;
+        // the producer may wait for the ring space held by the writes
+        drain_urgent(ring, writer);
+        while (!ring_ready(ring, ring->taken) && writer_busy(writer))
+            writer_flush(writer);
+        const slot_t *slot = ring_take(ring);
+        if (!slot)
+            continue;
+        if (slot->flags & RING_EOF)
         {
             flag = 0;
         }
         else
         {
+            char *data = ring_data(ring, slot);
+            bool last = !(slot->flags & RING_MORE);
 
-            bytes = strlen(shared_memory) + 1;
-            strcpy(buf, shared_memory);
-
-            sem_post(sem_write);
-
-            buf[bytes - 1] = '\0';
-            str_reverse(buf);
-            buf[bytes - 1] = '\n';
-
-            int32_t written = write(file, buf, bytes);
-            if (written != bytes)
+            // A line is reversed in place part by part and written straight
+            // from the ring. A line that would hold too much of the ring is
+            // copied out instead, so the server never waits for its end
+            if (!spilled && (count_parts == MAX_PARTS - 1 || held + slot->length > RING_DATA / 2))
             {
-                const char msg[] = "error: client failed to write to file\n";
-                write(STDERR_FILENO, msg, sizeof(msg));
-                exit(EXIT_FAILURE);
+                for (int i = 0; i < count_parts; ++i)
+                    append(&buf, &size, &bytes, parts[MAX_PARTS - 2 - i].iov_base, parts[MAX_PARTS - 2 - i].iov_len);
+                count_parts = 0;
+                held = 0;
+                spilled = true;
             }
+            if (spilled)
+            {
+                append(&buf, &size, &bytes, data, slot->length);
+                writer_hold(writer, ring->taken);
+                if (!last)
+                    continue;
+                append(&buf, &size, &bytes, "\n", 1);
+                str_reverse(buf, bytes - 1);
+                // the writer frees the copy once it is written
+                writer_line(writer, &(struct iovec){buf, bytes}, 1, buf);
+                buf = NULL;
+                size = bytes = 0;
+                spilled = false;
+                continue;
+            }
+
+            // the parts are stored backwards, so the iovecs come out reversed
+            parts[MAX_PARTS - 2 - count_parts++] = (struct iovec){data, slot->length};
+            held += slot->length;
+            if (!last)
+                continue;
+
+            parts[MAX_PARTS - 1] = (struct iovec){"\n", 1};
+            for (int i = 0; i < count_parts; ++i)
+                str_reverse(parts[MAX_PARTS - 2 - i].iov_base, parts[MAX_PARTS - 2 - i].iov_len);
+            writer_line(writer, &parts[MAX_PARTS - 1 - count_parts], count_parts + 1, NULL);
+            writer_hold(writer, ring->taken);
+            count_parts = 0;
+            held = 0;
         }
     } while (flag);
+    free(buf);
+}
 
-    if (close(file) == -1)
+// takes lines from the shared queue whenever this client is free
+void pull(queue_t *queue, writer_t *writer)
+{
+    char *chunk = malloc(QUEUE_LINE + 1), *buf = NULL;
+    size_t size = 0, bytes = 0;
+    uint32_t flags = 0;
+    if (!chunk)
     {
-        const char msg[] = "error: client failed to close file\n";
+        const char msg[] = "error: client failed to allocate memory\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    while (true)
+    {
+        uint32_t length = queue_pop(queue, chunk, &flags);
+        if (flags & QUEUE_EOF)
+            break;
+        if (!(flags & QUEUE_MORE) && !bytes)
+        {
+            str_reverse(chunk, length);
+            chunk[length] = '\n';
+            writer_copy(writer, chunk, length + 1);
+            continue;
+        }
+        // the parts of a long line are put together first
+        append(&buf, &size, &bytes, chunk, length);
+        if (flags & QUEUE_MORE)
+            continue;
+        append(&buf, &size, &bytes, "\n", 1);
+        str_reverse(buf, bytes - 1);
+        writer_line(writer, &(struct iovec){buf, bytes}, 1, buf);
+        buf = NULL;
+        size = bytes = 0;
+    }
+    free(chunk);
+    free(buf);
+}
+
+// reads every line of the broadcast ring; the ring is shared by all
+// clients, so a line is reversed in a copy of our own and its space is
+// given back at once
+void follow(broadcast_t *channel, uint32_t index, writer_t *writer)
+{
+    char *buf = NULL;
+    size_t size = 0, bytes = 0;
+    while (true)
+    {
+        const slot_t *slot = broadcast_take(channel, index);
+        uint32_t flags = slot->flags;
+        if (flags & RING_EOF)
+            break;
+        append(&buf, &size, &bytes, broadcast_data(channel, slot), slot->length);
+        broadcast_release(channel, index);
+        if (flags & RING_MORE)
+            continue;
+        str_reverse(buf, bytes);
+        append(&buf, &size, &bytes, "\n", 1);
+        writer_copy(writer, buf, bytes);
+        bytes = 0;
+    }
+    broadcast_release(channel, index);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    pid_t pid = getpid();
+
+    if (argc < 4)
+    {
+        const char msg[] = "usage: client <filename> <segment fd> <channel> [--mmap-output], started by server\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+
+    // NOTE: `O_WRONLY` only enables file for writing
+    // NOTE: `O_CREAT` creates the requested file if absent
+    // NOTE: `O_TRUNC` empties the file prior to opening
+    // NOTE: no `O_APPEND`, every write names its offset, so several can be in flight
+    // NOTE: a shared writable mapping needs `O_RDWR`
+    bool map = argc > 4 && !strcmp(argv[4], "--mmap-output");
+    int32_t file = open(argv[1], (map ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0600);
+    if (file == -1)
+    {
+        const char msg[] = "error: failed to open requested file\n";
         write(STDERR_FILENO, msg, sizeof(msg));
         exit(EXIT_FAILURE);
     }
-    if (sem_close(sem_write) == -1 || sem_close(sem_read) == -1)
+
+    // argv[2] is the segment descriptor inherited from the server, argv[3] our channel
+    int shm_fd = atoi(argv[2]);
+    uint32_t channel = atoi(argv[3]);
+    segment_t *segment = segment_attach(shm_fd);
+    if (!segment || ((segment->flags & SEGMENT_BROADCAST) && channel >= segment_broadcast(segment)->count_readers) ||
+        (!(segment->flags & (SEGMENT_QUEUE | SEGMENT_BROADCAST)) && channel >= segment->count_channels))
     {
-        const char msg[] = "error: client failed to sem_close\n";
+        const char msg[] = "error: failed to map shared memory";
         write(STDERR_FILENO, msg, sizeof(msg));
         exit(EXIT_FAILURE);
     }
 
-    if (munmap(shared_memory, BUFFER_SIZE) == -1)
+    static writer_t writer;
+    if (segment->flags & SEGMENT_QUEUE)
+    {
+        writer_init(&writer, file, NULL, map);
+        pull(segment_queue(segment), &writer);
+    }
+    else if (segment->flags & SEGMENT_BROADCAST)
+    {
+        writer_init(&writer, file, NULL, map);
+        follow(segment_broadcast(segment), channel, &writer);
+    }
+    else
+    {
+        writer_init(&writer, file, &segment->channels[channel], map);
+        drain(&segment->channels[channel], &writer);
+    }
+    writer_close(&writer);
+
+    if (close(file) == -1)
+    {
+        const char msg[] = "error: client failed to close file\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
+    if (munmap(segment, segment->size) == -1)
     {
         const char msg[] = "error: client failed to munmap";
         write(STDERR_FILENO, msg, sizeof(msg));
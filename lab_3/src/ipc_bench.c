@@ -0,0 +1,312 @@
+#include "lib.h"
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define WARMUP 100
+#define MAX_MESSAGE (64 * 1024)
+
+// Round trips and one-way streaming between two processes over every
+// channel kind used in the labs. Receivers copy the data into a private
+// buffer in every transport, so the numbers compare like with like.
+
+static const size_t sizes[] = {16, 64, 256, 1024, 4096, 16384, 65536};
+
+// the original lab_3 channel: one buffer, a semaphore handshake per message
+typedef struct handshake_t
+{
+    sem_t empty, full;
+    size_t length;
+    char data[MAX_MESSAGE];
+} handshake_t;
+
+typedef struct endpoint_t
+{
+    int in_fd, out_fd;
+    ring_t *in_ring, *out_ring;
+    segment_t *segment;
+    int segment_fd;
+    handshake_t *in_slot, *out_slot;
+} endpoint_t;
+
+typedef struct transport_t
+{
+    const char *name;
+    void (*open)(endpoint_t *parent, endpoint_t *child);
+    void (*send)(endpoint_t *endpoint, const char *data, size_t size);
+    void (*recv)(endpoint_t *endpoint, char *buf, size_t size);
+    void (*close)(endpoint_t *parent, endpoint_t *child); // in the parent, after the child exits
+} transport_t;
+
+void fail(const char *text)
+{
+    write(STDERR_FILENO, text, strlen(text));
+    exit(EXIT_FAILURE);
+}
+
+void *shared_alloc(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        fail("error: failed to map shared memory\n");
+    return memory;
+}
+
+void fd_send(endpoint_t *endpoint, const char *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t written = write(endpoint->out_fd, data, size);
+        if (written <= 0)
+            fail("error: failed to write\n");
+        data += written;
+        size -= written;
+    }
+}
+
+void fd_recv(endpoint_t *endpoint, char *buf, size_t size)
+{
+    while (size)
+    {
+        ssize_t bytes = read(endpoint->in_fd, buf, size);
+        if (bytes <= 0)
+            fail("error: failed to read\n");
+        buf += bytes;
+        size -= bytes;
+    }
+}
+
+void fd_close(endpoint_t *parent, endpoint_t *child)
+{
+    close(parent->in_fd);
+    close(parent->out_fd);
+    close(child->in_fd);
+    close(child->out_fd);
+}
+
+void pipe_open(endpoint_t *parent, endpoint_t *child)
+{
+    int there[2], back[2];
+    if (pipe(there) == -1 || pipe(back) == -1)
+        fail("error: failed to create pipe\n");
+    *parent = (endpoint_t){.in_fd = back[0], .out_fd = there[1]};
+    *child = (endpoint_t){.in_fd = there[0], .out_fd = back[1]};
+}
+
+void socket_open(endpoint_t *parent, endpoint_t *child)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+        fail("error: failed to create socket pair\n");
+    *parent = (endpoint_t){.in_fd = pair[0], .out_fd = pair[0]};
+    *child = (endpoint_t){.in_fd = pair[1], .out_fd = pair[1]};
+}
+
+void socket_close(endpoint_t *parent, endpoint_t *child)
+{
+    close(parent->in_fd);
+    close(child->in_fd);
+}
+
+void handshake_open(endpoint_t *parent, endpoint_t *child)
+{
+    handshake_t *there = shared_alloc(sizeof(handshake_t)), *back = shared_alloc(sizeof(handshake_t));
+    if (sem_init(&there->empty, 1, 1) == -1 || sem_init(&there->full, 1, 0) == -1 ||
+        sem_init(&back->empty, 1, 1) == -1 || sem_init(&back->full, 1, 0) == -1)
+        fail("error: failed to init semaphore\n");
+    *parent = (endpoint_t){.in_slot = back, .out_slot = there};
+    *child = (endpoint_t){.in_slot = there, .out_slot = back};
+}
+
+void handshake_send(endpoint_t *endpoint, const char *data, size_t size)
+{
+    sem_wait(&endpoint->out_slot->empty);
+    memcpy(endpoint->out_slot->data, data, size);
+    endpoint->out_slot->length = size;
+    sem_post(&endpoint->out_slot->full);
+}
+
+void handshake_recv(endpoint_t *endpoint, char *buf, size_t size)
+{
+    sem_wait(&endpoint->in_slot->full);
+    memcpy(buf, endpoint->in_slot->data, size);
+    sem_post(&endpoint->in_slot->empty);
+}
+
+void handshake_close(endpoint_t *parent, endpoint_t *child)
+{
+    (void)child;
+    munmap(parent->in_slot, sizeof(handshake_t));
+    munmap(parent->out_slot, sizeof(handshake_t));
+}
+
+// both directions in one segment, set up the way the server does it
+void ring_open_with(endpoint_t *parent, endpoint_t *child, notify_t notify, bool huge)
+{
+    int fd;
+    segment_t *segment = segment_create(2, huge ? SEGMENT_HUGE : 0, notify, &fd);
+    if (!segment)
+        fail("error: failed to create shared memory\n");
+    ring_t *there = &segment->channels[0], *back = &segment->channels[1];
+    *parent = (endpoint_t){.in_ring = back, .out_ring = there, .segment = segment, .segment_fd = fd};
+    *child = (endpoint_t){.in_ring = there, .out_ring = back};
+}
+
+void ring_sem_open(endpoint_t *parent, endpoint_t *child)
+{
+    ring_open_with(parent, child, NOTIFY_SEM, false);
+}
+
+void ring_futex_open(endpoint_t *parent, endpoint_t *child)
+{
+    ring_open_with(parent, child, NOTIFY_FUTEX, false);
+}
+
+void ring_huge_open(endpoint_t *parent, endpoint_t *child)
+{
+    ring_open_with(parent, child, NOTIFY_FUTEX, true);
+}
+
+void ring_send_message(endpoint_t *endpoint, const char *data, size_t size)
+{
+    ring_push(endpoint->out_ring, data, size, 0);
+}
+
+void ring_recv_message(endpoint_t *endpoint, char *buf, size_t size)
+{
+    const slot_t *slot = ring_take(endpoint->in_ring);
+    memcpy(buf, ring_data(endpoint->in_ring, slot), size);
+    ring_release(endpoint->in_ring);
+}
+
+void ring_close(endpoint_t *parent, endpoint_t *child)
+{
+    (void)child;
+    segment_destroy(parent->segment, parent->segment_fd);
+}
+
+static const transport_t transports[] = {
+    {"handshake", handshake_open, handshake_send, handshake_recv, handshake_close},
+    {"pipe", pipe_open, fd_send, fd_recv, fd_close},
+    {"socket", socket_open, fd_send, fd_recv, socket_close},
+    {"ring", ring_sem_open, ring_send_message, ring_recv_message, ring_close},
+    {"ring-futex", ring_futex_open, ring_send_message, ring_recv_message, ring_close},
+    {"ring-futex-huge", ring_huge_open, ring_send_message, ring_recv_message, ring_close},
+};
+
+uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile_us(const uint64_t *sorted, int count, double fraction)
+{
+    int index = (int)(fraction * count + 0.999999) - 1;
+    return sorted[index < 0 ? 0 : index] / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 20000;
+    size_t stream_bytes = 64 * 1024 * 1024;
+    const char *output = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bytes") && i + 1 < argc)
+            stream_bytes = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+            output = argv[++i];
+        else
+        {
+            char msg[256];
+            int len = snprintf(msg, sizeof(msg), "usage: %s [--iterations <n>][--bytes <stream bytes>][--output <file.csv>]\n", argv[0]);
+            write(STDERR_FILENO, msg, len);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (iterations <= 0 || !stream_bytes)
+        fail("error: iterations and bytes must be positive\n");
+
+    FILE *csv = output ? fopen(output, "w") : stdout;
+    if (!csv)
+        fail("error: failed to open output file\n");
+    fprintf(csv, "transport,size,p50_us,p99_us,p999_us,max_us,throughput_mb_s\n");
+
+    static char buf[MAX_MESSAGE];
+    uint64_t *rtt = malloc(iterations * sizeof(uint64_t));
+    if (!rtt)
+        fail("error: failed to allocate memory\n");
+    memset(buf, 'x', sizeof(buf));
+
+    for (size_t t = 0; t < sizeof(transports) / sizeof(transports[0]); ++t)
+    {
+        const transport_t *transport = &transports[t];
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+        {
+            size_t size = sizes[s];
+            size_t count_stream = stream_bytes / size ? stream_bytes / size : 1;
+            endpoint_t parent, child;
+            transport->open(&parent, &child);
+
+            const pid_t pid = fork();
+            if (pid == -1)
+                fail("error: failed to spawn new process\n");
+            if (pid == 0)
+            {
+                // echo every round trip, then swallow the stream and ack it
+                for (int i = 0; i < WARMUP + iterations; ++i)
+                {
+                    transport->recv(&child, buf, size);
+                    transport->send(&child, buf, size);
+                }
+                for (size_t i = 0; i < count_stream; ++i)
+                    transport->recv(&child, buf, size);
+                transport->send(&child, buf, 1);
+                _exit(EXIT_SUCCESS);
+            }
+
+            for (int i = 0; i < WARMUP + iterations; ++i)
+            {
+                uint64_t start = now_ns();
+                transport->send(&parent, buf, size);
+                transport->recv(&parent, buf, size);
+                if (i >= WARMUP)
+                    rtt[i - WARMUP] = now_ns() - start;
+            }
+
+            uint64_t start = now_ns();
+            for (size_t i = 0; i < count_stream; ++i)
+                transport->send(&parent, buf, size);
+            transport->recv(&parent, buf, 1);
+            double seconds = (now_ns() - start) / 1e9;
+
+            int child_status;
+            if (waitpid(pid, &child_status, 0) == -1 || !WIFEXITED(child_status) ||
+                WEXITSTATUS(child_status) != EXIT_SUCCESS)
+                fail("error: child exited with error\n");
+            transport->close(&parent, &child);
+
+            qsort(rtt, iterations, sizeof(uint64_t), compare_u64);
+            fprintf(csv, "%s,%zu,%.2lf,%.2lf,%.2lf,%.2lf,%.1lf\n", transport->name, size,
+                    percentile_us(rtt, iterations, 0.5), percentile_us(rtt, iterations, 0.99),
+                    percentile_us(rtt, iterations, 0.999), rtt[iterations - 1] / 1e3,
+                    count_stream * size / seconds / 1e6);
+            fflush(csv);
+        }
+    }
+
+    free(rtt);
+    if (output && fclose(csv))
+        fail("error: failed to close output file\n");
+    return 0;
+}
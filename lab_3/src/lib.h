@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/mman.h>
@@ -9,13 +10,7 @@
 #include <unistd.h>
 #include <semaphore.h>
 
-#define SHM_NAME_1 "/shm112"
-#define SHM_NAME_2 "/shm222"
+#include "ring.h"
+#include "segment.h"
 
-#define SEM_WRITE_1 "/sw112"
-#define SEM_WRITE_2 "/sw222"
-
-#define SEM_READ_1 "/sr112"
-#define SEM_READ_2 "/sr222"
-
-#define BUFFER_SIZE 1024
\ No newline at end of file
+#define BUFFER_SIZE (64 * 1024)
\ No newline at end of file
@@ -0,0 +1,242 @@
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+#include <limits.h>
+
+#include "ring.h"
+
+#define QUEUE_CELLS 8192 // a power of two
+#define CELL_SIZE 256
+#define CELL_DATA (CELL_SIZE - 16)
+#define QUEUE_RECORD (QUEUE_CELLS / 4)      // cells of one record at most
+#define QUEUE_LINE (QUEUE_RECORD * CELL_DATA) // bytes of one record at most
+#define QUEUE_SPIN 1024
+
+#define QUEUE_EOF 1u  // one per consumer, it takes nothing after it
+#define QUEUE_MORE 2u // the line continues in the next record
+
+#define QUEUE_LOCKED (1ull << 63) // in the dequeue cursor: a consumer takes the parts of a line
+
+// Bounded multi-producer multi-consumer queue in shared memory after
+// Vyukov: every cell carries a sequence number that tells whether it is
+// free or filled for the current lap, and a producer (consumer) owns a
+// position once its CAS moved the enqueue (dequeue) cursor past it. A
+// record spans consecutive cells and is claimed as a whole with a single
+// CAS, so a line always goes to one consumer, which copies it out and
+// frees its cells before working on it. A line longer than a record goes
+// in parts; the consumer that takes the first part locks the dequeue
+// cursor and moves it alone until the last part. It takes whatever record
+// comes next as the continuation, so the parts of a line need a single
+// producer: with two, their parts would interleave. Sleeping is done on
+// futexes over counters that move on every publish and release. The
+// statistics have several writers, so they are added up atomically.
+
+typedef struct cell_t
+{
+    _Atomic uint64_t sequence;
+    uint32_t length; // bytes of the record, in its first cell only
+    uint32_t flags;
+    char data[CELL_DATA];
+} cell_t;
+
+typedef struct queue_t
+{
+    // written by the producers
+    _Alignas(CACHE_LINE) _Atomic uint64_t enqueue_position;
+    atomic_uint published;
+    _Atomic uint64_t messages, bytes;
+    _Atomic uint64_t high_water; // cells in use at most
+    _Atomic uint64_t producer_wait_ns;
+    _Atomic uint64_t consumer_wakeups;
+
+    // written by the consumers
+    _Alignas(CACHE_LINE) _Atomic uint64_t dequeue_position;
+    atomic_uint released;
+    _Atomic uint64_t consumer_wait_ns;
+    _Atomic uint64_t producer_wakeups;
+
+    _Alignas(CACHE_LINE) atomic_int producers_waiting;
+    atomic_int consumers_waiting;
+    int spin;
+    _Alignas(CACHE_LINE) cell_t cells[QUEUE_CELLS];
+} queue_t;
+
+static inline void queue_init(queue_t *queue)
+{
+    queue->spin = ring_spin_budget(QUEUE_SPIN);
+    atomic_init(&queue->enqueue_position, 0);
+    atomic_init(&queue->published, 0);
+    atomic_init(&queue->dequeue_position, 0);
+    atomic_init(&queue->released, 0);
+    atomic_init(&queue->producers_waiting, 0);
+    atomic_init(&queue->consumers_waiting, 0);
+    atomic_init(&queue->messages, 0);
+    atomic_init(&queue->bytes, 0);
+    atomic_init(&queue->high_water, 0);
+    atomic_init(&queue->producer_wait_ns, 0);
+    atomic_init(&queue->consumer_wakeups, 0);
+    atomic_init(&queue->consumer_wait_ns, 0);
+    atomic_init(&queue->producer_wakeups, 0);
+    for (uint64_t i = 0; i < QUEUE_CELLS; ++i)
+        atomic_init(&queue->cells[i].sequence, i);
+}
+
+static inline uint32_t queue_cells(uint32_t length)
+{
+    return length ? (length + CELL_DATA - 1) / CELL_DATA : 1;
+}
+
+static inline cell_t *queue_cell(queue_t *queue, uint64_t position)
+{
+    return &queue->cells[position % QUEUE_CELLS];
+}
+
+// Polls ready() for a while, then sleeps until *counter moves on. The
+// sleeper announces itself before the last check, and the peer moves the
+// counter before it looks for sleepers, so no wake is lost
+static inline void queue_wait(queue_t *queue, atomic_uint *counter, atomic_int *waiting,
+                              bool (*ready)(queue_t *, uint64_t), uint64_t arg, _Atomic uint64_t *wait_ns)
+{
+    uint64_t start = ring_now();
+    for (int i = 0; i < queue->spin && !ready(queue, arg); ++i)
+        ring_relax();
+    if (!ready(queue, arg))
+    {
+        atomic_fetch_add(waiting, 1);
+        unsigned seen = atomic_load(counter);
+        if (!ready(queue, arg))
+            syscall(SYS_futex, counter, FUTEX_WAIT, seen, NULL, NULL, 0);
+        atomic_fetch_sub(waiting, 1);
+    }
+    atomic_fetch_add_explicit(wait_ns, ring_now() - start, memory_order_relaxed);
+}
+
+static inline void queue_signal(atomic_uint *counter, atomic_int *waiting, int count, _Atomic uint64_t *wakeups)
+{
+    atomic_fetch_add(counter, 1);
+    if (atomic_load(waiting))
+    {
+        syscall(SYS_futex, counter, FUTEX_WAKE, count, NULL, NULL, 0);
+        atomic_fetch_add_explicit(wakeups, 1, memory_order_relaxed);
+    }
+}
+
+static inline bool queue_free(queue_t *queue, uint64_t position, uint32_t count)
+{
+    // consumers free their records in any order, so every cell is checked
+    for (uint32_t i = 0; i < count; ++i)
+        if ((int64_t)(atomic_load_explicit(&queue_cell(queue, position + i)->sequence, memory_order_acquire) -
+                      (position + i)) < 0)
+            return false;
+    return true;
+}
+
+static inline bool queue_fits(queue_t *queue, uint64_t count)
+{
+    return queue_free(queue, atomic_load(&queue->enqueue_position), count);
+}
+
+// owner is set for the consumer that holds the cursor locked
+static inline bool queue_filled(queue_t *queue, uint64_t owner)
+{
+    uint64_t position = atomic_load(&queue->dequeue_position);
+    if ((position & QUEUE_LOCKED) && !owner)
+        return false;
+    position &= ~QUEUE_LOCKED;
+    return (int64_t)(atomic_load_explicit(&queue_cell(queue, position)->sequence, memory_order_acquire) -
+                     (position + 1)) >= 0;
+}
+
+// a record with QUEUE_MORE must be followed by the rest of its line from the
+// same producer before any other producer pushes
+static inline int queue_push(queue_t *queue, const void *data, uint32_t length, uint32_t flags)
+{
+    if (length > QUEUE_LINE)
+        return -1;
+    uint32_t count = queue_cells(length);
+    uint64_t position = atomic_load(&queue->enqueue_position);
+    while (!queue_free(queue, position, count) ||
+           !atomic_compare_exchange_weak(&queue->enqueue_position, &position, position + count))
+    {
+        if (!queue_free(queue, position, count))
+        {
+            queue_wait(queue, &queue->released, &queue->producers_waiting, queue_fits, count, &queue->producer_wait_ns);
+            position = atomic_load(&queue->enqueue_position);
+        }
+    }
+
+    // the first cell goes last: a consumer that sees it filled finds the whole record
+    for (uint32_t i = count; i-- > 0;)
+    {
+        cell_t *cell = queue_cell(queue, position + i);
+        uint32_t offset = i * CELL_DATA;
+        if (length > offset)
+            memcpy(cell->data, (const char *)data + offset, (length - offset < CELL_DATA) ? length - offset : CELL_DATA);
+        cell->length = i ? 0 : length;
+        cell->flags = flags;
+        atomic_store_explicit(&cell->sequence, position + i + 1, memory_order_release);
+    }
+    // the parts of a line wait for one consumer in particular
+    queue_signal(&queue->published, &queue->consumers_waiting,
+                 (atomic_load(&queue->dequeue_position) & QUEUE_LOCKED) ? INT_MAX : 1, &queue->consumer_wakeups);
+
+    atomic_fetch_add_explicit(&queue->messages, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->bytes, length, memory_order_relaxed);
+    uint64_t in_use = position + count - (atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed) & ~QUEUE_LOCKED);
+    uint64_t high_water = atomic_load_explicit(&queue->high_water, memory_order_relaxed);
+    while (in_use > high_water && in_use <= QUEUE_CELLS &&
+           !atomic_compare_exchange_weak_explicit(&queue->high_water, &high_water, in_use, memory_order_relaxed, memory_order_relaxed))
+        ;
+    return 0;
+}
+
+// Copies the next record into buf, which holds QUEUE_LINE bytes, and frees
+// its cells; waits while the queue is empty. *flags holds the flags of the
+// previous record, 0 at first. Returns the record length
+static inline uint32_t queue_pop(queue_t *queue, char *buf, uint32_t *flags)
+{
+    bool owner = *flags & QUEUE_MORE;
+    uint64_t position = atomic_load(&queue->dequeue_position);
+    cell_t *cell;
+    while (true)
+    {
+        if (owner)
+            position &= ~QUEUE_LOCKED;
+        cell = queue_cell(queue, position);
+        int64_t lap = atomic_load_explicit(&cell->sequence, memory_order_acquire) - (position + 1);
+        if (!(position & QUEUE_LOCKED) && lap == 0)
+        {
+            // the record can not change before the cursor passes it
+            uint64_t next = (position + queue_cells(cell->length)) | ((cell->flags & QUEUE_MORE) ? QUEUE_LOCKED : 0);
+            if (owner)
+            {
+                atomic_store(&queue->dequeue_position, next);
+                break;
+            }
+            if (atomic_compare_exchange_weak(&queue->dequeue_position, &position, next))
+                break;
+            continue;
+        }
+        if ((position & QUEUE_LOCKED) || lap < 0)
+            queue_wait(queue, &queue->published, &queue->consumers_waiting, queue_filled, owner, &queue->consumer_wait_ns);
+        position = atomic_load(&queue->dequeue_position);
+    }
+
+    uint32_t length = cell->length;
+    *flags = cell->flags;
+    for (uint32_t i = 0; i < queue_cells(length); ++i)
+    {
+        cell_t *part = queue_cell(queue, position + i);
+        uint32_t offset = i * CELL_DATA;
+        if (length > offset)
+            memcpy(buf + offset, part->data, (length - offset < CELL_DATA) ? length - offset : CELL_DATA);
+        atomic_store_explicit(&part->sequence, position + i + QUEUE_CELLS, memory_order_release);
+    }
+    queue_signal(&queue->released, &queue->producers_waiting, INT_MAX, &queue->producer_wakeups);
+    // the others may have slept through the publishes behind the line
+    if (owner && !(*flags & QUEUE_MORE))
+        queue_signal(&queue->published, &queue->consumers_waiting, INT_MAX, &queue->consumer_wakeups);
+    return length;
+}
+
+#endif
@@ -0,0 +1,471 @@
+#ifndef __RING_H
+#define __RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CACHE_LINE 64
+#define RING_SLOTS 4096     // messages in flight, a power of two
+#define RING_DATA (1 << 20) // bytes in flight
+#define RING_MESSAGE (RING_DATA / 4)
+#define RING_LANE_SLOTS 64 // urgent messages in flight, a power of two
+#define RING_URGENT 240    // bytes of one urgent message at most
+#define RING_LATENCY 40    // log2 buckets of the time a message waits in the ring, in ns
+
+#define RING_EOF 1u  // the producer has nothing more to send
+#define RING_MORE 2u // the message continues in the next slot
+
+#define RING_SPIN_MIN 64 // polls of the peer before sleeping, adapted at run time
+#define RING_SPIN_MAX 16384
+
+typedef enum notify_t
+{
+    NOTIFY_SEM,   // process-shared semaphores
+    NOTIFY_FUTEX, // spin, then sleep on the waiting flag itself
+} notify_t;
+
+// Single-producer single-consumer channel in shared memory. A message is a
+// slot pointing into the data area, so the producer can run far ahead of
+// the consumer and the consumer drains everything published without
+// waiting. Each side sleeps on its semaphore only when the ring is empty
+// (full) and is posted only when it really sleeps. With NOTIFY_FUTEX a
+// side first polls the peer for a while, so a running peer costs no
+// syscalls at all. Each side keeps statistics on its own cache line for
+// shmstat; wait times are counted when a wait ends.
+//
+// Next to the bulk ring runs a small urgent lane of fixed cells that the
+// consumer empties before it takes the next bulk message, so a short
+// urgent message never queues behind a ring full of bulk data. Both lanes
+// share the doorbells. A timed ring stamps every message with the time it
+// was published and the consumer keeps a latency histogram per lane; that
+// costs a clock read on each side per message, so rings are timed only on
+// request.
+
+typedef enum lane_t
+{
+    LANE_BULK,
+    LANE_URGENT,
+    LANES,
+} lane_t;
+
+typedef struct slot_t
+{
+    uint64_t position; // offset in the data area, counted without wrapping
+    uint32_t length;
+    uint32_t flags;
+    uint64_t sent; // ring_now() at publishing, 0 unless the ring is timed
+} slot_t;
+
+typedef struct urgent_t
+{
+    uint64_t sent;
+    uint32_t length;
+    char data[RING_URGENT];
+} urgent_t;
+
+typedef struct ring_t
+{
+    // written by the producer
+    _Alignas(CACHE_LINE) atomic_uint head; // slots published
+    atomic_uint urgent_head;
+    atomic_int producer_waiting;
+    uint64_t data_head; // producer only
+    int producer_spin;
+    _Atomic uint64_t messages, bytes;
+    _Atomic uint64_t high_water; // bytes in flight at most
+    _Atomic uint64_t producer_wait_ns;
+    _Atomic uint64_t consumer_wakeups; // posts and futex wakes sent to the consumer
+
+    // written by the consumer
+    _Alignas(CACHE_LINE) atomic_uint tail; // slots released
+    atomic_uint urgent_tail;
+    atomic_int consumer_waiting;
+    _Atomic uint64_t data_tail;
+    unsigned taken; // consumer only
+    int consumer_spin;
+    _Atomic uint64_t consumer_wait_ns;
+    _Atomic uint64_t producer_wakeups;
+    _Atomic uint64_t latency[LANES][RING_LATENCY];
+
+    _Alignas(CACHE_LINE) notify_t notify;
+    bool timed;
+    sem_t data_ready;
+    sem_t space_ready;
+    slot_t slots[RING_SLOTS];
+    urgent_t lane[RING_LANE_SLOTS];
+    _Alignas(CACHE_LINE) char data[RING_DATA];
+} ring_t;
+
+// Polls of the peer a side starts with. On a single cpu the peer can not
+// run at the same time, so polling it only burns the cpu and nobody spins
+static inline int ring_spin_budget(int spin)
+{
+    return (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? spin : 0;
+}
+
+static inline int ring_init(ring_t *ring, notify_t notify, bool timed)
+{
+    int spin = (notify == NOTIFY_FUTEX) ? ring_spin_budget(RING_SPIN_MIN) : 0;
+    ring->notify = notify;
+    ring->timed = timed;
+    ring->producer_spin = ring->consumer_spin = spin;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->urgent_head, 0);
+    atomic_init(&ring->producer_waiting, 0);
+    ring->data_head = 0;
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->urgent_tail, 0);
+    atomic_init(&ring->consumer_waiting, 0);
+    atomic_init(&ring->data_tail, 0);
+    ring->taken = 0;
+    atomic_init(&ring->messages, 0);
+    atomic_init(&ring->bytes, 0);
+    atomic_init(&ring->high_water, 0);
+    atomic_init(&ring->producer_wait_ns, 0);
+    atomic_init(&ring->consumer_wakeups, 0);
+    atomic_init(&ring->consumer_wait_ns, 0);
+    atomic_init(&ring->producer_wakeups, 0);
+    for (int lane = 0; lane < LANES; ++lane)
+        for (int i = 0; i < RING_LATENCY; ++i)
+            atomic_init(&ring->latency[lane][i], 0);
+    if (sem_init(&ring->data_ready, 1, 0) == -1 || sem_init(&ring->space_ready, 1, 0) == -1)
+        return -1;
+    return 0;
+}
+
+static inline void ring_destroy(ring_t *ring)
+{
+    sem_destroy(&ring->data_ready);
+    sem_destroy(&ring->space_ready);
+}
+
+// a counter with a single writer needs no locked instruction
+static inline void ring_count(_Atomic uint64_t *counter, uint64_t value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline uint64_t ring_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// counts a message that was published at sent into the histogram of its lane
+static inline void ring_latency(ring_t *ring, lane_t lane, uint64_t sent)
+{
+    uint64_t now = ring_now();
+    int bucket = (now > sent) ? 64 - __builtin_clzll(now - sent) : 0;
+    ring_count(&ring->latency[lane][(bucket < RING_LATENCY) ? bucket : RING_LATENCY - 1], 1);
+}
+
+static inline void ring_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+// Sleeps unless the peer changed the ring after *waiting was raised; the
+// condition must be checked between raising the flag and this call
+static inline void ring_park(ring_t *ring, atomic_int *waiting, sem_t *sem, bool blocked)
+{
+    if (ring->notify == NOTIFY_FUTEX)
+    {
+        // the waker clears the flag before the wake, so a changed flag
+        // makes FUTEX_WAIT return at once
+        if (!blocked)
+            atomic_store(waiting, 0);
+        while (atomic_load(waiting))
+            syscall(SYS_futex, waiting, FUTEX_WAIT, 1, NULL, NULL, 0);
+        return;
+    }
+    // a peer that cleared the flag has posted or is about to post
+    if (blocked || !atomic_exchange(waiting, 0))
+        while (sem_wait(sem) == -1 && errno == EINTR)
+            ;
+}
+
+// true if the peer was asleep
+static inline bool ring_wake(ring_t *ring, atomic_int *waiting, sem_t *sem)
+{
+    if (!atomic_load(waiting) || !atomic_exchange(waiting, 0))
+        return false;
+    if (ring->notify == NOTIFY_FUTEX)
+        syscall(SYS_futex, waiting, FUTEX_WAKE, 1, NULL, NULL, 0);
+    else
+        sem_post(sem);
+    return true;
+}
+
+// polls ready() up to *spin times; the budget grows while polling pays off
+// and shrinks while the side ends up sleeping anyway
+static inline bool ring_spin(ring_t *ring, int *spin, bool (*ready)(ring_t *, uint64_t), uint64_t arg)
+{
+    for (int i = 0; i < *spin; ++i)
+    {
+        if (ready(ring, arg))
+        {
+            if (*spin < RING_SPIN_MAX)
+                *spin *= 2;
+            return true;
+        }
+        ring_relax();
+    }
+    if (*spin > RING_SPIN_MIN)
+        *spin /= 2;
+    return false;
+}
+
+// Reservation helpers, shared with broadcast.h
+
+// slots and bytes a consumer released; tail first: its store publishes data_tail
+static inline unsigned ring_load_tail(atomic_uint *tail, _Atomic uint64_t *data_tail, uint64_t *data)
+{
+    unsigned slots = atomic_load(tail);
+    *data = atomic_load(data_tail);
+    return slots;
+}
+
+// where size bytes can start at or after data_head; the data of a message never wraps
+static inline uint64_t ring_place(uint64_t data_head, uint32_t size)
+{
+    uint32_t offset = data_head % RING_DATA;
+    return (offset + size > RING_DATA) ? data_head + RING_DATA - offset : data_head;
+}
+
+// contiguous free bytes at position while data_tail is not released
+static inline uint32_t ring_available(uint64_t position, uint64_t data_tail)
+{
+    uint64_t free = RING_DATA - (position - data_tail);
+    uint32_t to_end = RING_DATA - position % RING_DATA;
+    return (free < to_end) ? free : to_end;
+}
+
+// position of data cut out of the reservation made at data_head
+static inline uint64_t ring_position(const char *area, uint64_t data_head, const char *data)
+{
+    return data_head + (data - (area + data_head % RING_DATA));
+}
+
+// fills the slot of the next message, moving head publishes it
+static inline slot_t *ring_fill(slot_t *slots, unsigned head, uint64_t position, uint32_t length, uint32_t flags)
+{
+    slot_t *slot = &slots[head % RING_SLOTS];
+    slot->position = position;
+    slot->length = length;
+    slot->flags = flags;
+    return slot;
+}
+
+static inline void ring_high_water(_Atomic uint64_t *high_water, uint64_t in_flight)
+{
+    if (in_flight > atomic_load_explicit(high_water, memory_order_relaxed))
+        atomic_store_explicit(high_water, in_flight, memory_order_relaxed);
+}
+
+static inline bool ring_fits(ring_t *ring, uint64_t end)
+{
+    uint64_t data_tail;
+    unsigned tail = ring_load_tail(&ring->tail, &ring->data_tail, &data_tail);
+    return end - data_tail <= RING_DATA && atomic_load_explicit(&ring->head, memory_order_relaxed) - tail < RING_SLOTS;
+}
+
+// waits until the data area is free up to end and a slot is free
+static inline void ring_wait_space(ring_t *ring, uint64_t end)
+{
+    if (ring_fits(ring, end))
+        return;
+    uint64_t start = ring_now();
+    if (!ring_spin(ring, &ring->producer_spin, ring_fits, end))
+    {
+        while (!ring_fits(ring, end))
+        {
+            atomic_store(&ring->producer_waiting, 1);
+            ring_park(ring, &ring->producer_waiting, &ring->space_ready, !ring_fits(ring, end));
+        }
+    }
+    ring_count(&ring->producer_wait_ns, ring_now() - start);
+}
+
+// Waits for size contiguous free bytes; the data of a message never wraps.
+// *available gets the whole contiguous free space, which may be larger
+static inline char *ring_reserve(ring_t *ring, uint32_t size, uint32_t *available)
+{
+    uint64_t position = ring_place(ring->data_head, size);
+    ring_wait_space(ring, position + size);
+    ring->data_head = position;
+    if (available)
+        *available = ring_available(position, atomic_load(&ring->data_tail));
+    return ring->data + position % RING_DATA;
+}
+
+// Publishes a message whose data lies in the reserved space. Several
+// messages may be cut out of one reservation, skipping bytes between them;
+// then only a free slot may need waiting for
+static inline void ring_commit(ring_t *ring, const char *data, uint32_t length, uint32_t flags)
+{
+    uint64_t position = ring_position(ring->data, ring->data_head, data);
+    ring_wait_space(ring, position + length);
+
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_fill(ring->slots, head, position, length, flags)->sent = ring->timed ? ring_now() : 0;
+    ring->data_head = position + length;
+    atomic_store(&ring->head, head + 1);
+    if (ring_wake(ring, &ring->consumer_waiting, &ring->data_ready))
+        ring_count(&ring->consumer_wakeups, 1);
+
+    ring_count(&ring->messages, 1);
+    ring_count(&ring->bytes, length);
+    ring_high_water(&ring->high_water, ring->data_head - atomic_load_explicit(&ring->data_tail, memory_order_relaxed));
+}
+
+static inline int ring_push(ring_t *ring, const void *data, uint32_t length, uint32_t flags)
+{
+    if (length > RING_MESSAGE)
+        return -1;
+    char *place = ring_reserve(ring, length, NULL);
+    if (length)
+        memcpy(place, data, length);
+    ring_commit(ring, place, length, flags);
+    return 0;
+}
+
+static inline bool ring_lane_fits(ring_t *ring, uint64_t unused)
+{
+    (void)unused;
+    return atomic_load_explicit(&ring->urgent_head, memory_order_relaxed) - atomic_load(&ring->urgent_tail) <
+           RING_LANE_SLOTS;
+}
+
+// Sends a short message through the urgent lane; it is copied into a cell
+// of its own and waits only for a free cell
+static inline int ring_push_urgent(ring_t *ring, const void *data, uint32_t length)
+{
+    if (length > RING_URGENT)
+        return -1;
+    if (!ring_lane_fits(ring, 0))
+    {
+        uint64_t start = ring_now();
+        if (!ring_spin(ring, &ring->producer_spin, ring_lane_fits, 0))
+        {
+            while (!ring_lane_fits(ring, 0))
+            {
+                atomic_store(&ring->producer_waiting, 1);
+                ring_park(ring, &ring->producer_waiting, &ring->space_ready, !ring_lane_fits(ring, 0));
+            }
+        }
+        ring_count(&ring->producer_wait_ns, ring_now() - start);
+    }
+
+    unsigned head = atomic_load_explicit(&ring->urgent_head, memory_order_relaxed);
+    urgent_t *cell = &ring->lane[head % RING_LANE_SLOTS];
+    memcpy(cell->data, data, length);
+    cell->length = length;
+    cell->sent = ring->timed ? ring_now() : 0;
+    atomic_store(&ring->urgent_head, head + 1);
+    if (ring_wake(ring, &ring->consumer_waiting, &ring->data_ready))
+        ring_count(&ring->consumer_wakeups, 1);
+
+    ring_count(&ring->messages, 1);
+    ring_count(&ring->bytes, length);
+    return 0;
+}
+
+static inline bool ring_filled(ring_t *ring, uint64_t taken)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) != (unsigned)taken;
+}
+
+static inline bool ring_urgent(ring_t *ring)
+{
+    return atomic_load_explicit(&ring->urgent_head, memory_order_acquire) !=
+           atomic_load_explicit(&ring->urgent_tail, memory_order_relaxed);
+}
+
+// something to take in either lane
+static inline bool ring_ready(ring_t *ring, uint64_t taken)
+{
+    return ring_urgent(ring) || ring_filled(ring, taken);
+}
+
+// Next bulk message, waits while both lanes are empty. NULL when an urgent
+// message came first: it is to be taken with ring_take_urgent() before
+// asking again
+static inline const slot_t *ring_take(ring_t *ring)
+{
+    unsigned taken = ring->taken;
+    if (!ring_ready(ring, taken))
+    {
+        uint64_t start = ring_now();
+        if (!ring_spin(ring, &ring->consumer_spin, ring_ready, taken))
+        {
+            while (!ring_ready(ring, taken))
+            {
+                atomic_store(&ring->consumer_waiting, 1);
+                ring_park(ring, &ring->consumer_waiting, &ring->data_ready, !ring_ready(ring, taken));
+            }
+        }
+        ring_count(&ring->consumer_wait_ns, ring_now() - start);
+    }
+    if (ring_urgent(ring))
+        return NULL;
+    ring->taken = taken + 1;
+    const slot_t *slot = &ring->slots[taken % RING_SLOTS];
+    if (ring->timed)
+        ring_latency(ring, LANE_BULK, slot->sent);
+    return slot;
+}
+
+// the oldest urgent message or NULL, without waiting; it stays in its cell
+// until ring_release_urgent()
+static inline const urgent_t *ring_take_urgent(ring_t *ring)
+{
+    if (!ring_urgent(ring))
+        return NULL;
+    const urgent_t *cell = &ring->lane[atomic_load_explicit(&ring->urgent_tail, memory_order_relaxed) % RING_LANE_SLOTS];
+    if (ring->timed)
+        ring_latency(ring, LANE_URGENT, cell->sent);
+    return cell;
+}
+
+static inline void ring_release_urgent(ring_t *ring)
+{
+    atomic_store(&ring->urgent_tail, atomic_load_explicit(&ring->urgent_tail, memory_order_relaxed) + 1);
+    if (ring_wake(ring, &ring->producer_waiting, &ring->space_ready))
+        ring_count(&ring->producer_wakeups, 1);
+}
+
+static inline char *ring_data(ring_t *ring, const slot_t *slot)
+{
+    return ring->data + slot->position % RING_DATA;
+}
+
+// gives the messages taken before the taken-th back to the producer
+static inline void ring_release_to(ring_t *ring, unsigned taken)
+{
+    const slot_t *last = &ring->slots[(taken - 1) % RING_SLOTS];
+    atomic_store_explicit(&ring->data_tail, last->position + last->length, memory_order_relaxed);
+    atomic_store(&ring->tail, taken);
+    if (ring_wake(ring, &ring->producer_waiting, &ring->space_ready))
+        ring_count(&ring->producer_wakeups, 1);
+}
+
+// gives every taken message back to the producer
+static inline void ring_release(ring_t *ring)
+{
+    ring_release_to(ring, ring->taken);
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef __SEGMENT_H
+#define __SEGMENT_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "queue.h"
+#include "broadcast.h"
+
+#define MAX_CLIENTS 64
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+#define SEGMENT_HUGE 1u    // huge pages wanted; every process faults the pages in and locks them at start
+#define SEGMENT_HUGETLB 2u // backed by reserved huge pages
+#define SEGMENT_QUEUE 4u     // one shared work queue instead of a ring per client
+#define SEGMENT_BROADCAST 8u // one ring that every client reads in full
+#define SEGMENT_LATENCY 16u  // the rings keep latency histograms for shmstat
+
+// All channels of one server live in one anonymous memfd segment. The
+// clients inherit its descriptor across exec, nothing gets a name in
+// /dev/shm, so any number of servers can run side by side and a crashed
+// run leaves nothing behind. With SEGMENT_QUEUE or SEGMENT_BROADCAST the
+// queue or the broadcast ring takes the place of the channels and
+// count_channels is 0.
+typedef struct segment_t
+{
+    uint32_t count_channels;
+    uint32_t flags;
+    uint64_t size; // mapped bytes, rounded up to huge pages if there are any
+    _Alignas(CACHE_LINE) ring_t channels[];
+} segment_t;
+
+static inline size_t segment_size(uint32_t count_channels, uint32_t flags)
+{
+    if (flags & SEGMENT_QUEUE)
+        return sizeof(segment_t) + sizeof(queue_t);
+    if (flags & SEGMENT_BROADCAST)
+        return sizeof(segment_t) + sizeof(broadcast_t);
+    return sizeof(segment_t) + count_channels * sizeof(ring_t);
+}
+
+static inline queue_t *segment_queue(segment_t *segment)
+{
+    return (queue_t *)segment->channels;
+}
+
+static inline broadcast_t *segment_broadcast(segment_t *segment)
+{
+    return (broadcast_t *)segment->channels;
+}
+
+// faults every page in now instead of on the first messages;
+// a locked-memory limit that is too low only skips the locking
+static inline void segment_prefault(segment_t *segment, size_t size)
+{
+    if (mlock(segment, size) == 0)
+        return;
+#ifdef MADV_POPULATE_WRITE
+    madvise(segment, size, MADV_POPULATE_WRITE);
+#endif
+}
+
+// Maps a new memfd; with SEGMENT_HUGE, from reserved huge pages when the
+// host has enough of them, otherwise from normal pages with a transparent
+// huge page hint, and prefaulted either way. *fd gets the memfd to hand to
+// the clients, NULL on error
+static inline segment_t *segment_create(uint32_t count_channels, uint32_t flags, notify_t notify, int *fd)
+{
+    uint32_t count_readers = count_channels;
+    if (flags & (SEGMENT_QUEUE | SEGMENT_BROADCAST))
+        count_channels = 0;
+    if ((flags & SEGMENT_BROADCAST) && count_readers > BROADCAST_READERS)
+        return NULL;
+    flags &= SEGMENT_HUGE | SEGMENT_QUEUE | SEGMENT_BROADCAST | SEGMENT_LATENCY;
+    size_t size = segment_size(count_channels, flags);
+    segment_t *segment = MAP_FAILED;
+
+    if ((flags & SEGMENT_HUGE) && (*fd = memfd_create("lab3", MFD_HUGETLB)) != -1)
+    {
+        size_t huge_size = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        // the huge pages are reserved at mmap, so a shortage shows up here
+        if (ftruncate(*fd, huge_size) == 0)
+            segment = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+        if (segment == MAP_FAILED)
+            close(*fd);
+        else
+        {
+            size = huge_size;
+            flags |= SEGMENT_HUGETLB;
+        }
+    }
+    if (segment == MAP_FAILED)
+    {
+        if ((*fd = memfd_create("lab3", 0)) == -1 || ftruncate(*fd, size) == -1)
+            return NULL;
+        segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+        if (segment == MAP_FAILED)
+            return NULL;
+        if (flags & SEGMENT_HUGE)
+            madvise(segment, size, MADV_HUGEPAGE);
+    }
+    if (flags & SEGMENT_HUGE)
+        segment_prefault(segment, size);
+
+    segment->count_channels = count_channels;
+    segment->flags = flags;
+    segment->size = size;
+    if (flags & SEGMENT_QUEUE)
+        queue_init(segment_queue(segment));
+    if (flags & SEGMENT_BROADCAST)
+        broadcast_init(segment_broadcast(segment), count_readers);
+    for (uint32_t i = 0; i < count_channels; ++i)
+        if (ring_init(&segment->channels[i], notify, flags & SEGMENT_LATENCY) == -1)
+            return NULL;
+    return segment;
+}
+
+static inline segment_t *segment_attach(int fd)
+{
+    struct stat info;
+    if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(segment_t))
+        return NULL;
+    segment_t *segment = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED)
+        return NULL;
+    if (segment->size != (size_t)info.st_size || segment_size(segment->count_channels, segment->flags) > segment->size)
+    {
+        munmap(segment, info.st_size);
+        return NULL;
+    }
+    if (segment->flags & SEGMENT_HUGE)
+        segment_prefault(segment, segment->size);
+    return segment;
+}
+
+static inline int segment_destroy(segment_t *segment, int fd)
+{
+    for (uint32_t i = 0; i < segment->count_channels; ++i)
+        ring_destroy(&segment->channels[i]);
+    if (munmap(segment, segment->size) == -1)
+        return -1;
+    return close(fd);
+}
+
+#endif
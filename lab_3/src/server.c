@@ -2,126 +2,265 @@
 
 static char CLIENT_PROGRAM_NAME[] = "client";
 
-int main(int argc, char **argv)
+// space for the next read, *size bytes
+typedef char *reserve_f(void *ctx, uint32_t *size);
+// a piece of a line; first - the line starts with it, last - the line ends with it
+typedef void emit_f(void *ctx, char *data, size_t length, bool first, bool last);
+
+// Reads stdin into the buffers reserve() hands out and passes the lines on
+// to emit() piece by piece: a line may span several reads and a read may
+// hold several lines. An empty line or the end of stdin ends the input. A
+// last line without a newline is ended by an empty piece, which lies in
+// the last buffer
+void split_input(void *ctx, reserve_f *reserve, emit_f *emit)
 {
-    int shm_fd1, shm_fd2;
-    if (argc == 1)
+    bool line_start = true;
+    while (true)
     {
-        char msg[1024];
-        uint32_t len = snprintf(msg, sizeof(msg) - 1, "usage: %s filename\n", argv[0]);
-        write(STDERR_FILENO, msg, len);
-        exit(EXIT_SUCCESS);
-    }
-
-    char progpath[1024];
-    {
-        ssize_t len = readlink("/proc/self/exe", progpath,
-                               sizeof(progpath) - 1);
-        if (len == -1)
+        uint32_t size;
+        char *buf = reserve(ctx, &size);
+        ssize_t bytes = read(STDIN_FILENO, buf, size);
+        if (bytes < 0)
         {
-            const char msg[] = "error: failed to read full program path\n";
+            const char msg[] = "error: failed to read from stdin\n";
             write(STDERR_FILENO, msg, sizeof(msg));
             exit(EXIT_FAILURE);
         }
+        if (!bytes)
+        {
+            if (!line_start)
+                emit(ctx, buf, 0, false, true);
+            return;
+        }
+        char *begin = buf, *end = buf + bytes;
+        while (begin < end)
+        {
+            char *newline = memchr(begin, '\n', end - begin);
+            size_t length = (newline ? newline : end) - begin;
+            if (newline && !length && line_start)
+                return;
+            emit(ctx, begin, length, line_start, newline);
+            begin = newline ? newline + 1 : end;
+            line_start = newline;
+        }
+    }
+}
 
-        while (progpath[len] != '/')
-            --len;
+typedef struct distributor_t
+{
+    segment_t *segment;
+    int count_clients;
+    bool priority;
+    int current;  // client of the next line
+    ring_t *ring; // the one the read buffer is reserved in
+} distributor_t;
+
+// stdin goes straight into the ring of the client whose line comes next,
+// so the bytes of that line are never copied
+char *distribute_reserve(void *ctx, uint32_t *size)
+{
+    distributor_t *distributor = ctx;
+    distributor->ring = &distributor->segment->channels[distributor->current];
+    uint32_t available;
+    char *buf = ring_reserve(distributor->ring, BUFFER_SIZE, &available);
+    *size = (available < RING_MESSAGE) ? available : RING_MESSAGE;
+    return buf;
+}
+
+// the producer only blocks when a client is a whole ring behind; lines of
+// the other clients are copied out once. A part without the newline goes
+// out with RING_MORE
+void distribute_emit(void *ctx, char *data, size_t length, bool first, bool last)
+{
+    distributor_t *distributor = ctx;
+    ring_t *ring = &distributor->segment->channels[distributor->current];
+    if (distributor->priority && first && last && length && *data == '!' && length <= RING_URGENT)
+        ring_push_urgent(ring, data, length);
+    else if (ring == distributor->ring)
+        ring_commit(ring, data, length, last ? 0 : RING_MORE);
+    else
+        ring_push(ring, data, length, last ? 0 : RING_MORE);
+    if (last)
+        distributor->current = (distributor->current + 1) % distributor->count_clients;
+}
+
+// Sends stdin line by line to the clients in turn: line i goes to client
+// i % count_clients. With priority a short line that starts with '!' takes
+// the urgent lane
+void distribute(segment_t *segment, int count_clients, bool priority)
+{
+    distributor_t distributor = {segment, count_clients, priority, 0, NULL};
+    split_input(&distributor, distribute_reserve, distribute_emit);
+    for (int i = 0; i < count_clients; ++i)
+        ring_push(&segment->channels[i], NULL, 0, RING_EOF);
+}
 
-        progpath[len] = '\0';
-    }
+char *broadcast_reserve_input(void *ctx, uint32_t *size)
+{
+    uint32_t available;
+    char *buf = broadcast_reserve(ctx, BUFFER_SIZE, &available);
+    *size = (available < RING_MESSAGE) ? available : RING_MESSAGE;
+    return buf;
+}
 
-    if ((shm_fd1 = shm_open(SHM_NAME_1, O_CREAT | O_RDWR, 0666)) == -1)
-    {
-        const char msg[] = "error: failed to open shared memory 1";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
-    }
-    if (ftruncate(shm_fd1, BUFFER_SIZE) == -1)
+void broadcast_emit(void *ctx, char *data, size_t length, bool first, bool last)
+{
+    (void)first;
+    broadcast_commit(ctx, data, length, last ? 0 : RING_MORE);
+}
+
+// Sends stdin to every client at once: the data is read straight into the
+// broadcast ring and nothing is copied on this side, however many clients
+// read it
+void broadcast(broadcast_t *channel)
+{
+    split_input(channel, broadcast_reserve_input, broadcast_emit);
+    broadcast_push(channel, NULL, 0, RING_EOF);
+}
+
+typedef struct balancer_t
+{
+    queue_t *queue;
+    char *line; // a line cut by a read, put together
+    size_t held;
+} balancer_t;
+
+char *balance_reserve(void *ctx, uint32_t *size)
+{
+    static char buf[BUFFER_SIZE];
+    (void)ctx;
+    *size = sizeof(buf);
+    return buf;
+}
+
+// a whole line goes from the read buffer into the queue, the parts of one
+// are put together first, and a line longer than a record goes in parts
+void balance_emit(void *ctx, char *data, size_t length, bool first, bool last)
+{
+    balancer_t *balancer = ctx;
+    (void)first;
+    while (balancer->held + length > QUEUE_LINE)
     {
-        const char msg[] = "error: failed to set size for shared memory 1";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
+        size_t part = QUEUE_LINE - balancer->held;
+        memcpy(balancer->line + balancer->held, data, part);
+        queue_push(balancer->queue, balancer->line, QUEUE_LINE, QUEUE_MORE);
+        balancer->held = 0;
+        data += part;
+        length -= part;
     }
-    if ((shm_fd2 = shm_open(SHM_NAME_2, O_CREAT | O_RDWR, 0666)) == -1)
+    if (!last || balancer->held)
     {
-        const char msg[] = "error: failed to open shared memory 2";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
+        memcpy(balancer->line + balancer->held, data, length);
+        balancer->held += length;
     }
-    if (ftruncate(shm_fd2, BUFFER_SIZE) == -1)
+    if (!last)
+        return;
+    if (balancer->held)
+        queue_push(balancer->queue, balancer->line, balancer->held, 0);
+    else
+        queue_push(balancer->queue, data, length, 0);
+    balancer->held = 0;
+}
+
+// Puts every line into the shared queue, the first client that is free
+// takes it; a line is copied out of the read buffer once
+void balance(queue_t *queue, int count_clients)
+{
+    balancer_t balancer = {queue, malloc(QUEUE_LINE), 0};
+    if (!balancer.line)
     {
-        const char msg[] = "error: failed to set size for shared memory 1";
+        const char msg[] = "error: failed to allocate memory\n";
         write(STDERR_FILENO, msg, sizeof(msg));
         exit(EXIT_FAILURE);
     }
+    split_input(&balancer, balance_reserve, balance_emit);
+    for (int i = 0; i < count_clients; ++i)
+        queue_push(queue, NULL, 0, QUEUE_EOF);
+    free(balancer.line);
+}
 
-    char *shared_memory1 = mmap(0, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd1, 0);
-    char *shared_memory2 = mmap(0, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd2, 0);
-    if (shared_memory1 == MAP_FAILED || shared_memory2 == MAP_FAILED)
+int main(int argc, char **argv)
+{
+    notify_t notify = NOTIFY_SEM;
+    bool huge = false, pull = false, all = false, priority = false, map = false;
+    char *files[MAX_CLIENTS];
+    int count_clients = 0;
+    for (int i = 1; i < argc; ++i)
     {
-        const char msg[] = "error: failed to map shared memory";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
+        if (!strcmp(argv[i], "--futex"))
+            notify = NOTIFY_FUTEX;
+        else if (!strcmp(argv[i], "--huge"))
+            huge = true;
+        else if (!strcmp(argv[i], "--balance"))
+            pull = true;
+        else if (!strcmp(argv[i], "--broadcast"))
+            all = true;
+        else if (!strcmp(argv[i], "--priority"))
+            priority = true;
+        else if (!strcmp(argv[i], "--mmap-output"))
+            map = true;
+        else if (!strncmp(argv[i], "--", 2))
+        {
+            const char msg[] = "error: unknown option\n";
+            write(STDERR_FILENO, msg, sizeof(msg));
+            exit(EXIT_FAILURE);
+        }
+        else if (count_clients == MAX_CLIENTS)
+        {
+            const char msg[] = "error: too many output files\n";
+            write(STDERR_FILENO, msg, sizeof(msg));
+            exit(EXIT_FAILURE);
+        }
+        else
+            files[count_clients++] = argv[i];
     }
-
-    sem_t *sem_write1 = sem_open(SEM_WRITE_1, O_CREAT | O_EXCL, 0644, 1);
-    sem_t *sem_read1 = sem_open(SEM_READ_1, O_CREAT | O_EXCL, 0644, 0);
-
-    sem_t *sem_write2 = sem_open(SEM_WRITE_2, O_CREAT | O_EXCL, 0644, 1);
-    sem_t *sem_read2 = sem_open(SEM_READ_2, O_CREAT | O_EXCL, 0644, 0);
-
-    if (sem_write1 == SEM_FAILED || sem_read1 == SEM_FAILED || sem_write1 == SEM_FAILED || sem_write2 == SEM_FAILED)
+    if ((pull && all) || (priority && (pull || all)))
     {
-        const char msg[] = "error: failed to open semaphore";
+        const char msg[] = "error: --balance, --broadcast and --priority exclude each other\n";
         write(STDERR_FILENO, msg, sizeof(msg));
         exit(EXIT_FAILURE);
     }
-
-    const pid_t child_1 = fork();
-    switch (child_1)
-    {
-    case -1:
+    if (!count_clients)
     {
-        const char msg[] = "error: failed to spawn new process\n";
-        write(STDERR_FILENO, msg, sizeof(msg));
-        exit(EXIT_FAILURE);
+        char msg[1024];
+        uint32_t len = snprintf(msg, sizeof(msg) - 1, "usage: %s [--futex][--huge][--balance | --broadcast | --priority][--mmap-output] filename...\n", argv[0]);
+        write(STDERR_FILENO, msg, len);
+        exit(EXIT_SUCCESS);
     }
-    break;
 
-    case 0:
+    char progpath[1024];
     {
-        pid_t pid = getpid();
-
+        ssize_t len = readlink("/proc/self/exe", progpath,
+                               sizeof(progpath) - 1);
+        if (len == -1)
         {
-            char msg[64];
-            const int32_t length = snprintf(msg, sizeof(msg),
-                                            "%d: I'm a child1\n", pid);
-            write(STDOUT_FILENO, msg, length);
+            const char msg[] = "error: failed to read full program path\n";
+            write(STDERR_FILENO, msg, sizeof(msg));
+            exit(EXIT_FAILURE);
         }
 
-        {
-            char path[1024];
-            snprintf(path, sizeof(path) - 1, "%s/%s", progpath, CLIENT_PROGRAM_NAME);
-
-            char *const args[] = {CLIENT_PROGRAM_NAME, argv[1], SEM_WRITE_1, SEM_READ_1, SHM_NAME_1, NULL};
-
-            int32_t status = execv(path, args);
+        while (progpath[len] != '/')
+            --len;
 
-            if (status == -1)
-            {
-                const char msg[] = "error: failed to exec into new exectuable image\n";
-                write(STDERR_FILENO, msg, sizeof(msg));
-                exit(EXIT_FAILURE);
-            }
-        }
+        progpath[len] = '\0';
     }
-    break;
 
-    default:
+    int segment_fd;
+    segment_t *segment = segment_create(count_clients, (huge ? SEGMENT_HUGE : 0) | (pull ? SEGMENT_QUEUE : 0) |
+                                                           (all ? SEGMENT_BROADCAST : 0) | (priority ? SEGMENT_LATENCY : 0),
+                                        notify, &segment_fd);
+    if (!segment)
     {
-        const pid_t child_2 = fork();
+        const char msg[] = "error: failed to create shared memory\n";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
+    }
 
-        switch (child_2)
+    pid_t children[MAX_CLIENTS];
+    for (int i = 0; i < count_clients; ++i)
+    {
+        children[i] = fork();
+        switch (children[i])
         {
         case -1:
         {
@@ -138,15 +277,19 @@ int main(int argc, char **argv)
             {
                 char msg[64];
                 const int32_t length = snprintf(msg, sizeof(msg),
-                                                "%d: I'm a child2\n", pid);
+                                                "%d: I'm a child%d\n", pid, i + 1);
                 write(STDOUT_FILENO, msg, length);
             }
 
             {
-                char path[1024];
+                char path[1024], fd_arg[16], channel_arg[16];
                 snprintf(path, sizeof(path) - 1, "%s/%s", progpath, CLIENT_PROGRAM_NAME);
+                snprintf(fd_arg, sizeof(fd_arg), "%d", segment_fd);
+                snprintf(channel_arg, sizeof(channel_arg), "%d", i);
+
+                // the memfd has no close-on-exec flag, so the client inherits it
+                char *const args[] = {CLIENT_PROGRAM_NAME, files[i], fd_arg, channel_arg, map ? "--mmap-output" : NULL, NULL};
 
-                char *const args[] = {CLIENT_PROGRAM_NAME, argv[2], SEM_WRITE_2, SEM_READ_2, SHM_NAME_2, NULL};
                 int32_t status = execv(path, args);
 
                 if (status == -1)
@@ -158,116 +301,48 @@ int main(int argc, char **argv)
             }
         }
         break;
+        }
+    }
 
-        default:
-        {
-            pid_t pid = getpid();
-
-            {
-                char msg[128];
-                const int32_t length = snprintf(msg, sizeof(msg),
-                                                "%d: I'm a parent, my child1 & child2 has PID %d %d\n", pid, child_1, child_2);
-                write(STDOUT_FILENO, msg, length);
-            }
-
-            char buf[BUFFER_SIZE];
-            ssize_t bytes;
-            int odd = 1;
-            {
-                sleep(1);
-                const char msg[] = "Input strings:\n";
-                write(STDOUT_FILENO, msg, sizeof(msg));
-            }
-            while (bytes = read(STDIN_FILENO, buf, sizeof(buf)))
-            {
-                if (bytes < 0)
-                {
-                    const char msg[] = "error: failed to read from stdin\n";
-                    write(STDERR_FILENO, msg, sizeof(msg));
-                    exit(EXIT_FAILURE);
-                }
-                else if (buf[0] == '\n')
-                {
-                    break;
-                }
-                {
-                    buf[bytes - 1] = '\0';
-                    int32_t written;
-                    if (odd)
-                    {
-                        sem_wait(sem_write1);
-                        snprintf(shared_memory1, BUFFER_SIZE, buf);
-                        sem_post(sem_read1);
-                    }
-
-                    else
-                    {
-                        sem_wait(sem_write2);
-                        snprintf(shared_memory2, BUFFER_SIZE, buf);
-                        sem_post(sem_read2);
-                    }
-
-                    odd = abs(odd - 1);
-                }
-            }
-            buf[0] = '\n';
-            sem_wait(sem_write1);
-            snprintf(shared_memory1, BUFFER_SIZE, buf);
-            sem_post(sem_read1);
-            sem_wait(sem_write2);
-            snprintf(shared_memory2, BUFFER_SIZE, buf);
-            sem_post(sem_read2);
-
-            if (sem_close(sem_write1) == -1 ||
-                sem_close(sem_write2) == -1 ||
-                sem_close(sem_read1) == -1 ||
-                sem_close(sem_read2) == -1)
-            {
-                const char msg[] = "error: failed to sem_close";
-                write(STDERR_FILENO, msg, sizeof(msg));
-                exit(EXIT_FAILURE);
-            }
-
-            if (sem_unlink(SEM_WRITE_1) == -1 ||
-                sem_unlink(SEM_WRITE_2) == -1 ||
-                sem_unlink(SEM_READ_1) == -1 ||
-                sem_unlink(SEM_READ_2) == -1)
-            {
-                const char msg[] = "error: failed to sem_unlink";
-                write(STDERR_FILENO, msg, sizeof(msg));
-                exit(EXIT_FAILURE);
-            }
-
-            if (munmap(shared_memory1, BUFFER_SIZE) || munmap(shared_memory2, BUFFER_SIZE))
-            {
-                const char msg[] = "error: failed to munmap";
-                write(STDERR_FILENO, msg, sizeof(msg));
-                exit(EXIT_FAILURE);
-            }
-
-            if (shm_unlink(SHM_NAME_1) == -1 || shm_unlink(SHM_NAME_2) == -1)
-            {
-                const char msg[] = "error: failed to shm_unlink";
-                write(STDERR_FILENO, msg, sizeof(msg));
-                exit(EXIT_FAILURE);
-            }
+    {
+        char msg[64 + 12 * MAX_CLIENTS];
+        int32_t length = snprintf(msg, sizeof(msg), "%d: I'm a parent, my children have PIDs", getpid());
+        for (int i = 0; i < count_clients; ++i)
+            length += snprintf(msg + length, sizeof(msg) - length, " %d", children[i]);
+        length += snprintf(msg + length, sizeof(msg) - length, "\n");
+        write(STDOUT_FILENO, msg, length);
+    }
 
-            int child_status;
-            pid_t wpid;
-            while ((wpid = wait(&child_status)) > 0)
-            {
-                if (child_status != EXIT_SUCCESS)
-                {
-                    const char msg[] = "error: child exited with error\n";
-                    write(STDERR_FILENO, msg, sizeof(msg));
-                    exit(child_status);
-                }
-            }
-        }
-        break;
+    {
+        sleep(1);
+        const char msg[] = "Input strings:\n";
+        write(STDOUT_FILENO, msg, sizeof(msg));
+    }
+    if (pull)
+        balance(segment_queue(segment), count_clients);
+    else if (all)
+        broadcast(segment_broadcast(segment));
+    else
+        distribute(segment, count_clients, priority);
+
+    int child_status;
+    pid_t wpid;
+    while ((wpid = wait(&child_status)) > 0)
+    {
+        if (child_status != EXIT_SUCCESS)
+        {
+            const char msg[] = "error: child exited with error\n";
+            write(STDERR_FILENO, msg, sizeof(msg));
+            exit(child_status);
         }
-        break;
     }
+
+    // the clients map the segment until they exit
+    if (segment_destroy(segment, segment_fd) == -1)
+    {
+        const char msg[] = "error: failed to munmap";
+        write(STDERR_FILENO, msg, sizeof(msg));
+        exit(EXIT_FAILURE);
     }
     return 0;
-}
\ No newline at end of file
+}
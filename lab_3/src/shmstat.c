@@ -0,0 +1,215 @@
+#include "lib.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#define SEGMENT_LINK "/memfd:lab3"
+
+// Attaches read-only to the segment of a running lab_3 server (or of one
+// of its clients) and prints what went through every channel each second.
+// A side that waits most of the time is faster than its peer: the other
+// one is the bottleneck. Waits are counted when they end, and the waits of
+// all consumers of the shared queue add up, so the shares may pass 100%.
+// A broadcast ring gets a row per reader: the traffic and the producer
+// side are shared, the rest is the reader's own. Rings also show how long
+// messages waited in each lane, as the median and the 99th percentile.
+
+typedef struct sample_t
+{
+    uint64_t messages, bytes, producer_wait_ns, consumer_wait_ns;
+    uint64_t producer_wakeups, consumer_wakeups, high_water;
+    uint64_t in_flight; // slots (cells) in use now
+    uint64_t latency[LANES][RING_LATENCY];
+} sample_t;
+
+void fail(const char *text)
+{
+    write(STDERR_FILENO, text, strlen(text));
+    exit(EXIT_FAILURE);
+}
+
+// opens the memfd through /proc, the way the process holds it
+int find_segment(pid_t pid)
+{
+    char path[64], link[256];
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+        fail("error: no such process or no access to its descriptors\n");
+    struct dirent *entry;
+    int fd = -1;
+    while (fd == -1 && (entry = readdir(dir)))
+    {
+        char fd_path[320];
+        snprintf(fd_path, sizeof(fd_path), "%s/%s", path, entry->d_name);
+        ssize_t len = readlink(fd_path, link, sizeof(link) - 1);
+        if (len <= 0)
+            continue;
+        link[len] = '\0';
+        if (!strncmp(link, SEGMENT_LINK, strlen(SEGMENT_LINK)))
+            fd = open(fd_path, O_RDONLY);
+    }
+    closedir(dir);
+    if (fd == -1)
+        fail("error: the process holds no lab_3 segment\n");
+    return fd;
+}
+
+void sample_ring(ring_t *ring, sample_t *sample)
+{
+    sample->messages = atomic_load_explicit(&ring->messages, memory_order_relaxed);
+    sample->bytes = atomic_load_explicit(&ring->bytes, memory_order_relaxed);
+    sample->producer_wait_ns = atomic_load_explicit(&ring->producer_wait_ns, memory_order_relaxed);
+    sample->consumer_wait_ns = atomic_load_explicit(&ring->consumer_wait_ns, memory_order_relaxed);
+    sample->producer_wakeups = atomic_load_explicit(&ring->producer_wakeups, memory_order_relaxed);
+    sample->consumer_wakeups = atomic_load_explicit(&ring->consumer_wakeups, memory_order_relaxed);
+    sample->high_water = atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+    sample->in_flight = atomic_load_explicit(&ring->head, memory_order_relaxed) -
+                        atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (int lane = 0; lane < LANES; ++lane)
+        for (int i = 0; i < RING_LATENCY; ++i)
+            sample->latency[lane][i] = atomic_load_explicit(&ring->latency[lane][i], memory_order_relaxed);
+}
+
+void sample_queue(queue_t *queue, sample_t *sample)
+{
+    sample->messages = atomic_load_explicit(&queue->messages, memory_order_relaxed);
+    sample->bytes = atomic_load_explicit(&queue->bytes, memory_order_relaxed);
+    sample->producer_wait_ns = atomic_load_explicit(&queue->producer_wait_ns, memory_order_relaxed);
+    sample->consumer_wait_ns = atomic_load_explicit(&queue->consumer_wait_ns, memory_order_relaxed);
+    sample->producer_wakeups = atomic_load_explicit(&queue->producer_wakeups, memory_order_relaxed);
+    sample->consumer_wakeups = atomic_load_explicit(&queue->consumer_wakeups, memory_order_relaxed);
+    sample->high_water = atomic_load_explicit(&queue->high_water, memory_order_relaxed);
+    sample->in_flight = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed) -
+                        (atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed) & ~QUEUE_LOCKED);
+}
+
+void sample_reader(broadcast_t *channel, uint32_t index, sample_t *sample)
+{
+    reader_t *reader = &channel->readers[index];
+    sample->messages = atomic_load_explicit(&channel->messages, memory_order_relaxed);
+    sample->bytes = atomic_load_explicit(&channel->bytes, memory_order_relaxed);
+    sample->producer_wait_ns = atomic_load_explicit(&channel->producer_wait_ns, memory_order_relaxed);
+    sample->consumer_wait_ns = atomic_load_explicit(&reader->wait_ns, memory_order_relaxed);
+    sample->producer_wakeups = atomic_load_explicit(&reader->producer_wakeups, memory_order_relaxed);
+    sample->consumer_wakeups = atomic_load_explicit(&channel->consumer_wakeups, memory_order_relaxed);
+    sample->high_water = atomic_load_explicit(&channel->high_water, memory_order_relaxed);
+    sample->in_flight = atomic_load_explicit(&channel->head, memory_order_relaxed) -
+                        atomic_load_explicit(&reader->tail, memory_order_relaxed);
+}
+
+void sample(segment_t *segment, uint32_t index, sample_t *sample)
+{
+    *sample = (sample_t){0};
+    if (segment->flags & SEGMENT_QUEUE)
+        sample_queue(segment_queue(segment), sample);
+    else if (segment->flags & SEGMENT_BROADCAST)
+        sample_reader(segment_broadcast(segment), index, sample);
+    else
+        sample_ring(&segment->channels[index], sample);
+}
+
+// the q-th quantile of the latencies counted between two samples, as the
+// upper bound of its bucket; 0 if nothing was counted
+uint64_t quantile(const uint64_t *now, const uint64_t *last, double q)
+{
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < RING_LATENCY; ++i)
+        total += now[i] - last[i];
+    if (!total)
+        return 0;
+    for (int i = 0; i < RING_LATENCY; ++i)
+    {
+        seen += now[i] - last[i];
+        if (seen >= q * total)
+            return 1ull << i;
+    }
+    return 1ull << (RING_LATENCY - 1);
+}
+
+void format_latency(char *text, size_t size, const sample_t *now, const sample_t *last, lane_t lane)
+{
+    uint64_t median = quantile(now->latency[lane], last->latency[lane], 0.5);
+    if (!median)
+        snprintf(text, size, "-");
+    else
+        snprintf(text, size, "%.1lf/%.1lf", median / 1e3, quantile(now->latency[lane], last->latency[lane], 0.99) / 1e3);
+}
+
+const char *bottleneck(double producer_wait, double consumer_wait)
+{
+    if (consumer_wait > producer_wait + 10)
+        return "producer";
+    if (producer_wait > consumer_wait + 10)
+        return "consumer";
+    return "-";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        char msg[256];
+        int len = snprintf(msg, sizeof(msg), "usage: %s <pid of server or client>\n", argv[0]);
+        write(STDERR_FILENO, msg, len);
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = atoi(argv[1]);
+    int fd = find_segment(pid);
+
+    struct stat info;
+    if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(segment_t))
+        fail("error: the segment is too small\n");
+    segment_t *segment = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED)
+        fail("error: failed to map shared memory\n");
+    if (segment->size != (size_t)info.st_size || segment_size(segment->count_channels, segment->flags) > segment->size)
+        fail("error: the segment does not look like a lab_3 segment\n");
+
+    bool queue = segment->flags & SEGMENT_QUEUE, all = segment->flags & SEGMENT_BROADCAST;
+    uint32_t count = queue ? 1 : all ? segment_broadcast(segment)->count_readers : segment->count_channels;
+    if (count > BROADCAST_READERS && all)
+        fail("error: the segment does not look like a lab_3 segment\n");
+    sample_t *last = calloc(count, sizeof(sample_t)), now;
+    if (!last)
+        fail("error: failed to allocate memory\n");
+    for (uint32_t i = 0; i < count; ++i)
+        sample(segment, i, &last[i]);
+    printf("pid %d: %s, %" PRIu32 " channel(s)%s\n", pid,
+           queue ? "shared queue" : all ? "broadcast ring" : "ring per client", count,
+           (segment->flags & SEGMENT_HUGETLB) ? ", huge pages" : "");
+
+    uint64_t then = ring_now();
+    // until the process exits; the counters are read as they are, without locks
+    while (!kill(pid, 0) || errno == EPERM)
+    {
+        sleep(1);
+        uint64_t elapsed = ring_now() - then;
+        then += elapsed;
+        double seconds = elapsed / 1e9;
+        printf("%7s %10s %9s %9s %9s %9s %10s %13s %15s %15s %s\n", "channel", "msg/s", "MB/s", "prod wait",
+               "cons wait", queue ? "cells" : "slots", "high water", "wakeups p/c", "bulk us p50/99", "urgent us p50/99",
+               "bottleneck");
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            sample(segment, i, &now);
+            double producer_wait = (now.producer_wait_ns - last[i].producer_wait_ns) / (elapsed / 100.0);
+            double consumer_wait = (now.consumer_wait_ns - last[i].consumer_wait_ns) / (elapsed / 100.0);
+            char channel[16] = "queue", wakeups[48], bulk[32], urgent[32];
+            if (!queue)
+                snprintf(channel, sizeof(channel), "%" PRIu32, i);
+            snprintf(wakeups, sizeof(wakeups), "%" PRIu64 "/%" PRIu64, now.producer_wakeups - last[i].producer_wakeups,
+                     now.consumer_wakeups - last[i].consumer_wakeups);
+            format_latency(bulk, sizeof(bulk), &now, &last[i], LANE_BULK);
+            format_latency(urgent, sizeof(urgent), &now, &last[i], LANE_URGENT);
+            printf("%7s %10.0lf %9.2lf %8.1lf%% %8.1lf%% %9" PRIu64 " %10" PRIu64 " %13s %15s %16s %s\n", channel,
+                   (now.messages - last[i].messages) / seconds, (now.bytes - last[i].bytes) / seconds / 1e6,
+                   producer_wait, consumer_wait, now.in_flight, now.high_water, wakeups, bulk, urgent,
+                   bottleneck(producer_wait, consumer_wait));
+            last[i] = now;
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
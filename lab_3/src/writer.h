@@ -0,0 +1,503 @@
+#ifndef __WRITER_H
+#define __WRITER_H
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "ring.h"
+
+#define WRITER_ENTRIES 256         // write requests in flight
+#define WRITER_BATCHES 256         // batches in flight
+#define WRITER_IOVECS 4096         // iovecs of the requests not submitted yet
+#define WRITER_BATCH_IOVECS 1024   // IOV_MAX
+#define WRITER_BATCH (256 * 1024)  // bytes that close a batch
+#define WRITER_FIXED_MIN (64 * 1024) // parts written from the registered ring on their own
+#define WRITER_EXTENT (64 * 1024 * 1024) // bytes of the file allocated and mapped at once
+
+// File output that does not wait for the disk. Consecutive lines are
+// gathered into a batch that goes out as one io_uring write at an explicit
+// offset, so batches may complete in any order. Long parts lying in the
+// ring go out on their own from the registered ring data. A ring release
+// waits behind the batch of the last line before it and happens once
+// every batch up to there is written. Without io_uring every line is
+// written at once. Mapped output makes no syscall per line at all: the
+// file grows by whole extents that are mapped and filled with plain
+// copies, and is cut to its length on close.
+
+typedef enum writer_mode_t
+{
+    WRITER_SYNC,   // pwritev
+    WRITER_VECTOR, // IORING_OP_WRITEV
+    WRITER_FIXED,  // IORING_OP_WRITE_FIXED from the registered ring data
+    WRITER_MMAP,   // copies into a shared mapping of the file
+} writer_mode_t;
+
+typedef struct batch_t
+{
+    unsigned requests; // not completed yet, one more while the batch is open
+    bool holds;        // gives the ring back up to taken once done
+    unsigned taken;
+    size_t length; // bytes not confirmed yet
+    char *owned;   // heap copy of lines, freed once written
+} batch_t;
+
+typedef struct writer_t
+{
+    writer_mode_t mode;
+    int file;
+    uint64_t offset; // of the next line
+    ring_t *ring;
+
+    int uring;
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned count_sqes;
+
+    unsigned queued;    // not submitted
+    unsigned in_flight; // not completed
+    struct iovec iovecs[WRITER_IOVECS];
+    unsigned count_iovecs;
+    batch_t batches[WRITER_BATCHES];
+    unsigned first_batch, count_batches;
+
+    // the last batch while lines are added to it
+    bool open;
+    uint64_t open_offset;
+    unsigned open_iovec, open_iovecs;
+    size_t staged; // bytes copied into its owned buffer
+
+    // the mapped extent
+    char *map;
+    uint64_t map_offset;
+} writer_t;
+
+static inline void writer_fail(void)
+{
+    const char msg[] = "error: client failed to write to file\n";
+    write(STDERR_FILENO, msg, sizeof(msg));
+    exit(EXIT_FAILURE);
+}
+
+// IORING_OP_WRITE came with the probe in 5.6, so a kernel without the
+// probe can not write single buffers either
+static inline bool writer_probe(int fd)
+{
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    bool supported = probe && syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+                     probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+                     (probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+// unmaps the rings of io_uring that are mapped
+static inline void writer_unmap(writer_t *writer)
+{
+    if (writer->sqes != MAP_FAILED)
+        munmap(writer->sqes, writer->count_sqes * sizeof(struct io_uring_sqe));
+    if (writer->cq_map != MAP_FAILED && writer->cq_map != writer->sq_map)
+        munmap(writer->cq_map, writer->cq_size);
+    if (writer->sq_map != MAP_FAILED)
+        munmap(writer->sq_map, writer->sq_size);
+}
+
+static inline int writer_setup(writer_t *writer)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(SYS_io_uring_setup, WRITER_ENTRIES, &params);
+    if (fd == -1)
+        return -1;
+    // the iovecs are reused once their requests are submitted
+    if (!(params.features & IORING_FEAT_SUBMIT_STABLE) || !writer_probe(fd))
+    {
+        close(fd);
+        return -1;
+    }
+
+    writer->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    writer->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        writer->sq_size = writer->cq_size = (writer->sq_size > writer->cq_size) ? writer->sq_size : writer->cq_size;
+    writer->sq_map = mmap(NULL, writer->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    writer->cq_map = (params.features & IORING_FEAT_SINGLE_MMAP)
+                         ? writer->sq_map
+                         : mmap(NULL, writer->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    writer->count_sqes = params.sq_entries;
+    writer->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (writer->sq_map == MAP_FAILED || writer->cq_map == MAP_FAILED || writer->sqes == MAP_FAILED)
+    {
+        writer_unmap(writer);
+        close(fd);
+        return -1;
+    }
+
+    char *sq = writer->sq_map, *cq = writer->cq_map;
+    writer->sq_head = (unsigned *)(sq + params.sq_off.head);
+    writer->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    writer->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    writer->sq_array = (unsigned *)(sq + params.sq_off.array);
+    writer->cq_head = (unsigned *)(cq + params.cq_off.head);
+    writer->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    writer->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    writer->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    writer->uring = fd;
+    return 0;
+}
+
+// ring is the one the lines are taken from, NULL if they never lie in a
+// ring; map asks for mapped output, which needs the file open for reading too
+static inline void writer_init(writer_t *writer, int file, ring_t *ring, bool map)
+{
+    writer->file = file;
+    writer->ring = ring;
+    writer->offset = 0;
+    writer->queued = writer->in_flight = writer->count_iovecs = 0;
+    writer->first_batch = writer->count_batches = 0;
+    writer->open = false;
+    writer->map = NULL;
+    writer->map_offset = 0;
+    writer->mode = map ? WRITER_MMAP : WRITER_SYNC;
+    if (map || writer_setup(writer) == -1)
+        return;
+    writer->mode = WRITER_VECTOR;
+    // pinning the ring once saves the page lookups of every write; the
+    // locked memory limit may not allow it
+    struct iovec data = {ring ? ring->data : NULL, RING_DATA};
+    if (ring && syscall(SYS_io_uring_register, writer->uring, IORING_REGISTER_BUFFERS, &data, 1) == 0)
+        writer->mode = WRITER_FIXED;
+}
+
+// Maps the extent that holds the current offset in place of the last one.
+// Its blocks are allocated up front, so the copies never fault on a full
+// disk; a file system without fallocate gets a sparse extent instead
+static inline void writer_map_next(writer_t *writer)
+{
+    if (writer->map)
+    {
+        // the pages stay dirty in the page cache, only the mapping goes
+        msync(writer->map, WRITER_EXTENT, MS_ASYNC);
+        munmap(writer->map, WRITER_EXTENT);
+        writer->map = NULL;
+    }
+    writer->map_offset = writer->offset / WRITER_EXTENT * WRITER_EXTENT;
+    if (fallocate(writer->file, 0, writer->map_offset, WRITER_EXTENT) == -1 &&
+        (errno != EOPNOTSUPP || ftruncate(writer->file, writer->map_offset + WRITER_EXTENT) == -1))
+        writer_fail();
+    void *map = mmap(NULL, WRITER_EXTENT, PROT_READ | PROT_WRITE, MAP_SHARED, writer->file, writer->map_offset);
+    if (map == MAP_FAILED)
+        writer_fail();
+    writer->map = map;
+#ifdef MADV_POPULATE_WRITE
+    madvise(writer->map, WRITER_EXTENT, MADV_POPULATE_WRITE);
+#endif
+}
+
+static inline void writer_map_copy(writer_t *writer, const char *data, size_t length)
+{
+    while (length)
+    {
+        if (!writer->map || writer->offset - writer->map_offset == WRITER_EXTENT)
+            writer_map_next(writer);
+        size_t room = writer->map_offset + WRITER_EXTENT - writer->offset;
+        size_t part = (length < room) ? length : room;
+        memcpy(writer->map + (writer->offset - writer->map_offset), data, part);
+        writer->offset += part;
+        data += part;
+        length -= part;
+    }
+}
+
+// drops the batches at the front that are written, releasing the ring behind them
+static inline void writer_retire(writer_t *writer)
+{
+    bool release = false;
+    unsigned taken = 0;
+    while (writer->count_batches && !writer->batches[writer->first_batch].requests)
+    {
+        batch_t *batch = &writer->batches[writer->first_batch];
+        if (batch->holds)
+        {
+            release = true;
+            taken = batch->taken;
+        }
+        free(batch->owned);
+        writer->first_batch = (writer->first_batch + 1) % WRITER_BATCHES;
+        --writer->count_batches;
+    }
+    if (release)
+        ring_release_to(writer->ring, taken);
+}
+
+static inline void writer_reap(writer_t *writer)
+{
+    unsigned head = *writer->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)writer->cq_tail, memory_order_acquire);
+    for (; head != tail; ++head)
+    {
+        struct io_uring_cqe *cqe = &writer->cqes[head & *writer->cq_mask];
+        batch_t *batch = &writer->batches[cqe->user_data];
+        if (cqe->res < 0)
+            writer_fail();
+        batch->length -= cqe->res;
+        --writer->in_flight;
+        // a short write only happens when the disk is full
+        if (!--batch->requests && batch->length)
+            writer_fail();
+    }
+    atomic_store_explicit((_Atomic unsigned *)writer->cq_head, head, memory_order_release);
+    writer_retire(writer);
+}
+
+// submits everything queued, waiting for at least wait completions
+static inline void writer_submit(writer_t *writer, unsigned wait)
+{
+    do
+    {
+        int submitted = syscall(SYS_io_uring_enter, writer->uring, writer->queued, wait,
+                                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            writer_fail();
+        if (submitted > 0)
+            writer->queued -= submitted;
+        writer_reap(writer);
+    } while (writer->queued);
+
+    // the iovecs of submitted requests are no longer needed, those of the open batch are
+    if (writer->open)
+        memmove(writer->iovecs, &writer->iovecs[writer->open_iovec], writer->open_iovecs * sizeof(struct iovec));
+    writer->open_iovec = 0;
+    writer->count_iovecs = writer->open ? writer->open_iovecs : 0;
+}
+
+static inline void writer_make_room(writer_t *writer)
+{
+    while (writer->in_flight == WRITER_ENTRIES)
+        writer_submit(writer, 1);
+}
+
+// needs room, see writer_make_room
+static inline void writer_queue(writer_t *writer, uint8_t opcode, const void *addr, uint32_t length, uint64_t offset, unsigned batch)
+{
+    unsigned tail = *writer->sq_tail, index = tail & *writer->sq_mask;
+    struct io_uring_sqe *sqe = &writer->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = writer->file;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = batch;
+    writer->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned *)writer->sq_tail, tail + 1, memory_order_release);
+    ++writer->queued;
+    ++writer->in_flight;
+    ++writer->batches[batch].requests;
+}
+
+static inline batch_t *writer_last(writer_t *writer)
+{
+    return &writer->batches[(writer->first_batch + writer->count_batches - 1) % WRITER_BATCHES];
+}
+
+// starts a batch at the current offset, held open by one request
+static inline batch_t *writer_begin(writer_t *writer)
+{
+    while (writer->count_batches == WRITER_BATCHES)
+        writer_submit(writer, writer->in_flight ? 1 : 0);
+    ++writer->count_batches;
+    batch_t *batch = writer_last(writer);
+    *batch = (batch_t){.requests = 1};
+    return batch;
+}
+
+static inline void writer_end(batch_t *batch)
+{
+    if (!--batch->requests && batch->length)
+        writer_fail();
+}
+
+// queues the open batch as one request
+static inline void writer_close_batch(writer_t *writer)
+{
+    if (!writer->open)
+        return;
+    writer_make_room(writer);
+    batch_t *batch = writer_last(writer);
+    unsigned index = batch - writer->batches;
+    struct iovec *iovecs = &writer->iovecs[writer->open_iovec];
+    if (writer->open_iovecs == 1)
+        writer_queue(writer, IORING_OP_WRITE, iovecs->iov_base, iovecs->iov_len, writer->open_offset, index);
+    else
+        writer_queue(writer, IORING_OP_WRITEV, iovecs, writer->open_iovecs, writer->open_offset, index);
+    writer->open = false;
+    writer_end(batch);
+}
+
+// adds the parts to the open batch, opening one if needed
+static inline void writer_gather(writer_t *writer, const struct iovec *parts, unsigned count, size_t length)
+{
+    if (writer->open && (writer->open_iovecs + count > WRITER_BATCH_IOVECS || writer_last(writer)->length >= WRITER_BATCH))
+        writer_close_batch(writer);
+    if (count > WRITER_IOVECS - writer->count_iovecs)
+    {
+        writer_close_batch(writer);
+        writer_submit(writer, 0);
+    }
+    if (!writer->open)
+    {
+        writer_begin(writer);
+        writer->open = true;
+        writer->open_offset = writer->offset;
+        writer->open_iovec = writer->count_iovecs;
+        writer->open_iovecs = 0;
+        writer->staged = 0;
+    }
+    memcpy(&writer->iovecs[writer->count_iovecs], parts, count * sizeof(struct iovec));
+    writer->count_iovecs += count;
+    writer->open_iovecs += count;
+    writer_last(writer)->length += length;
+    writer->offset += length;
+}
+
+// Writes the parts as the next line. Parts in the ring must stay there
+// until a writer_hold() behind them releases it; owned is freed once written
+static inline void writer_line(writer_t *writer, const struct iovec *parts, int count, char *owned)
+{
+    size_t length = 0;
+    bool alone = owned;
+    for (int i = 0; i < count; ++i)
+    {
+        length += parts[i].iov_len;
+        alone |= writer->mode == WRITER_FIXED && parts[i].iov_len >= WRITER_FIXED_MIN;
+    }
+    if (writer->mode == WRITER_MMAP)
+    {
+        for (int i = 0; i < count; ++i)
+            writer_map_copy(writer, parts[i].iov_base, parts[i].iov_len);
+        free(owned);
+        return;
+    }
+    if (writer->mode == WRITER_SYNC)
+    {
+        if (pwritev(writer->file, parts, count, writer->offset) != (ssize_t)length)
+            writer_fail();
+        writer->offset += length;
+        free(owned);
+        return;
+    }
+    if (!alone)
+    {
+        writer_gather(writer, parts, count, length);
+        return;
+    }
+
+    // a line of its own, every part a request of its own
+    writer_close_batch(writer);
+    batch_t *batch = writer_begin(writer);
+    unsigned index = batch - writer->batches;
+    batch->length = length;
+    batch->owned = owned;
+    for (int i = 0; i < count; ++i)
+    {
+        const char *base = parts[i].iov_base;
+        bool fixed = writer->mode == WRITER_FIXED && base >= writer->ring->data && base < writer->ring->data + RING_DATA;
+        writer_make_room(writer);
+        writer_queue(writer, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, base, parts[i].iov_len, writer->offset, index);
+        writer->offset += parts[i].iov_len;
+    }
+    writer_end(batch);
+}
+
+// writes a line whose buffer the caller reuses at once; short lines are
+// copied into a buffer that the open batch owns
+static inline void writer_copy(writer_t *writer, const char *data, size_t length)
+{
+    if (writer->mode == WRITER_SYNC || writer->mode == WRITER_MMAP)
+    {
+        writer_line(writer, &(struct iovec){(void *)data, length}, 1, NULL);
+        return;
+    }
+    if (length > WRITER_BATCH / 4)
+    {
+        char *copy = malloc(length);
+        if (!copy)
+            writer_fail();
+        writer_line(writer, &(struct iovec){memcpy(copy, data, length), length}, 1, copy);
+        return;
+    }
+    if (writer->open && (writer->staged + length > WRITER_BATCH || !writer_last(writer)->owned))
+        writer_close_batch(writer);
+    writer_gather(writer, &(struct iovec){(void *)data, length}, 1, length);
+    batch_t *batch = writer_last(writer);
+    if (!batch->owned && !(batch->owned = malloc(WRITER_BATCH)))
+        writer_fail();
+    // the iovec just gathered points at the caller's buffer until now
+    writer->iovecs[writer->count_iovecs - 1].iov_base = memcpy(batch->owned + writer->staged, data, length);
+    writer->staged += length;
+}
+
+// gives the messages taken before the taken-th back once every line so far is written
+static inline void writer_hold(writer_t *writer, unsigned taken)
+{
+    if (!writer->count_batches)
+    {
+        ring_release_to(writer->ring, taken);
+        return;
+    }
+    writer_last(writer)->holds = true;
+    writer_last(writer)->taken = taken;
+}
+
+// true while lines are written, keeping part of the ring
+static inline bool writer_busy(writer_t *writer)
+{
+    return writer->count_batches;
+}
+
+// sends the open batch and all queued without waiting
+static inline void writer_send(writer_t *writer)
+{
+    if (writer->mode == WRITER_SYNC || writer->mode == WRITER_MMAP)
+        return;
+    writer_close_batch(writer);
+    writer_submit(writer, 0);
+}
+
+// sends the open batch and all queued, and waits for a write to complete if any is in flight
+static inline void writer_flush(writer_t *writer)
+{
+    if (writer->mode == WRITER_SYNC || writer->mode == WRITER_MMAP)
+        return;
+    writer_close_batch(writer);
+    writer_submit(writer, writer->in_flight ? 1 : 0);
+}
+
+static inline void writer_close(writer_t *writer)
+{
+    if (writer->mode == WRITER_MMAP)
+    {
+        // the last extent is only partly written
+        if (writer->map)
+            munmap(writer->map, WRITER_EXTENT);
+        if (ftruncate(writer->file, writer->offset) == -1)
+            writer_fail();
+        return;
+    }
+    if (writer->mode == WRITER_SYNC)
+        return;
+    while (writer->count_batches)
+        writer_flush(writer);
+    writer_unmap(writer);
+    close(writer->uring);
+}
+
+#endif
@@ -0,0 +1,300 @@
+#include "allocator.h"
+
+#include <stddef.h>
+
+#ifdef _MSC_VER
+#define EXPORT __declspec(dllexport)
+#else
+#define EXPORT
+#endif
+
+// Two-level segregated fit (TLSF): свободные блоки лежат в списках по
+// классам размеров. Первый уровень - степень двойки размера, второй делит
+// её на SL_INDEX_COUNT равных частей. Непустые списки отмечены битами в
+// битовых картах, поэтому подходящий список находится парой инструкций
+// поиска бита, а выделение и освобождение выполняются за O(1). Соседние
+// свободные блоки сливаются сразу при освобождении.
+
+#define ALIGN_SIZE_LOG2 3
+#define ALIGN_SIZE (1 << ALIGN_SIZE_LOG2)
+
+#define SL_INDEX_COUNT_LOG2 5
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+
+// Блоки меньше SMALL_BLOCK_SIZE делятся на классы линейно, в классе 0
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_MAX 48 // Блоки до 256 ТиБ
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE ((size_t)1 << FL_INDEX_SHIFT)
+
+#define BLOCK_FREE ((size_t)1)
+
+static size_t __USED_MEMORY = 0;
+
+// Заголовок блока. Поля списка свободных блоков лежат в полезной части
+// и существуют только у свободного блока
+typedef struct block_header
+{
+    struct block_header *prev_phys; // Предыдущий блок в памяти
+    size_t size;                    // Размер полезной части; младший бит - блок свободен
+
+    struct block_header *next_free; // Соседи в списке своего класса
+    struct block_header *prev_free;
+} block_header;
+
+#define BLOCK_OVERHEAD offsetof(block_header, next_free)
+#define BLOCK_SIZE_MIN (sizeof(block_header) - BLOCK_OVERHEAD)
+#define BLOCK_SIZE_MAX (((size_t)1 << FL_INDEX_MAX) - ALIGN_SIZE)
+
+// Структура аллокатора
+struct Allocator
+{
+    uint64_t fl_bitmap;                 // Непустые классы первого уровня
+    uint32_t sl_bitmap[FL_INDEX_COUNT]; // Непустые списки внутри каждого из них
+    block_header *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    size_t size;
+    size_t used; // Всё, кроме полезной части свободных блоков
+};
+
+static inline int fls_sizet(size_t value)
+{
+    return 63 - __builtin_clzll(value);
+}
+
+static inline size_t block_size(const block_header *block)
+{
+    return block->size & ~BLOCK_FREE;
+}
+
+static inline bool block_is_free(const block_header *block)
+{
+    return block->size & BLOCK_FREE;
+}
+
+static inline void *block_to_ptr(block_header *block)
+{
+    return (uint8_t *)block + BLOCK_OVERHEAD;
+}
+
+static inline block_header *block_from_ptr(void *const ptr)
+{
+    return (block_header *)((uint8_t *)ptr - BLOCK_OVERHEAD);
+}
+
+static inline block_header *block_next(block_header *block)
+{
+    return (block_header *)((uint8_t *)block_to_ptr(block) + block_size(block));
+}
+
+// Класс, в котором лежит блок данного размера
+static inline void mapping_insert(size_t size, int *fl, int *sl)
+{
+    if (size < SMALL_BLOCK_SIZE)
+    {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    }
+    else
+    {
+        int bit = fls_sizet(size);
+        *sl = (size >> (bit - SL_INDEX_COUNT_LOG2)) ^ (1 << SL_INDEX_COUNT_LOG2);
+        *fl = bit - (FL_INDEX_SHIFT - 1);
+    }
+}
+
+// Первый класс, любой блок которого вмещает size: размер округляется
+// вверх до границы класса, чтобы не перебирать блоки внутри списка
+static inline void mapping_search(size_t size, int *fl, int *sl)
+{
+    if (size >= SMALL_BLOCK_SIZE)
+        size += ((size_t)1 << (fls_sizet(size) - SL_INDEX_COUNT_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+static block_header *search_suitable_block(Allocator *const allocator, int *fl, int *sl)
+{
+    if (*fl >= FL_INDEX_COUNT)
+        return NULL;
+
+    // Сначала список того же класса первого уровня, не меньше sl
+    uint32_t sl_map = allocator->sl_bitmap[*fl] & (~0u << *sl);
+    if (!sl_map)
+    {
+        // Затем наименьший непустой класс первого уровня выше
+        uint64_t fl_map = (*fl + 1 < 64) ? allocator->fl_bitmap & (~(uint64_t)0 << (*fl + 1)) : 0;
+        if (!fl_map)
+            return NULL;
+        *fl = __builtin_ctzll(fl_map);
+        sl_map = allocator->sl_bitmap[*fl];
+    }
+    *sl = __builtin_ctz(sl_map);
+    return allocator->blocks[*fl][*sl];
+}
+
+static void remove_free_block(Allocator *const allocator, block_header *block, int fl, int sl)
+{
+    block_header *prev = block->prev_free, *next = block->next_free;
+    if (next)
+        next->prev_free = prev;
+    if (prev)
+        prev->next_free = next;
+    else
+    {
+        allocator->blocks[fl][sl] = next;
+        if (!next)
+        {
+            allocator->sl_bitmap[fl] &= ~(1u << sl);
+            if (!allocator->sl_bitmap[fl])
+                allocator->fl_bitmap &= ~((uint64_t)1 << fl);
+        }
+    }
+    block->size &= ~BLOCK_FREE;
+    allocator->used += block_size(block);
+    __USED_MEMORY += block_size(block);
+}
+
+static void insert_free_block(Allocator *const allocator, block_header *block)
+{
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    block_header *head = allocator->blocks[fl][sl];
+    block->next_free = head;
+    block->prev_free = NULL;
+    if (head)
+        head->prev_free = block;
+    allocator->blocks[fl][sl] = block;
+    allocator->fl_bitmap |= (uint64_t)1 << fl;
+    allocator->sl_bitmap[fl] |= 1u << sl;
+    block->size |= BLOCK_FREE;
+    allocator->used -= block_size(block);
+    __USED_MEMORY -= block_size(block);
+}
+
+static void remove_block(Allocator *const allocator, block_header *block)
+{
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    remove_free_block(allocator, block, fl, sl);
+}
+
+// Функция для инициализации аллокатора
+EXPORT Allocator *allocator_create(void *const memory, const size_t size)
+{
+    size_t header = (sizeof(Allocator) + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    if (memory == NULL || size < header + 2 * BLOCK_OVERHEAD + BLOCK_SIZE_MIN)
+        return NULL;
+
+    Allocator *allocator = (Allocator *)memory;
+    allocator->fl_bitmap = 0;
+    for (int i = 0; i < FL_INDEX_COUNT; ++i)
+    {
+        allocator->sl_bitmap[i] = 0;
+        for (int j = 0; j < SL_INDEX_COUNT; ++j)
+            allocator->blocks[i][j] = NULL;
+    }
+    allocator->size = size;
+    allocator->used = size;
+    __USED_MEMORY += size;
+
+    // Вся память - один свободный блок, за ним занятый блок нулевого
+    // размера, чтобы слияние не выходило за её конец
+    size_t pool = (size - header - 2 * BLOCK_OVERHEAD) & ~(size_t)(ALIGN_SIZE - 1);
+    if (pool > BLOCK_SIZE_MAX)
+        pool = BLOCK_SIZE_MAX;
+    block_header *block = (block_header *)((uint8_t *)memory + header);
+    block->prev_phys = NULL;
+    block->size = pool;
+    block_header *sentinel = block_next(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+    insert_free_block(allocator, block);
+
+    return allocator;
+}
+
+// Функция для деинициализации аллокатора
+EXPORT void allocator_destroy(Allocator *const allocator)
+{
+    if (allocator == NULL)
+        return;
+
+    __USED_MEMORY -= allocator->used;
+    allocator->fl_bitmap = 0;
+    allocator->size = 0;
+    allocator->used = 0;
+}
+
+// Функция для выделения памяти
+EXPORT void *allocator_alloc(Allocator *const allocator, const size_t size)
+{
+    if (allocator == NULL || size == 0 || size > BLOCK_SIZE_MAX)
+        return NULL;
+
+    size_t adjusted = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    if (adjusted < BLOCK_SIZE_MIN)
+        adjusted = BLOCK_SIZE_MIN;
+
+    int fl, sl;
+    mapping_search(adjusted, &fl, &sl);
+    block_header *block = search_suitable_block(allocator, &fl, &sl);
+    if (block == NULL)
+    {
+        // В классе самого размера блок тоже может подойти; смотрим только
+        // первый блок списка, чтобы не терять O(1)
+        mapping_insert(adjusted, &fl, &sl);
+        if (fl >= FL_INDEX_COUNT)
+            return NULL;
+        block = allocator->blocks[fl][sl];
+        if (block == NULL || block_size(block) < adjusted)
+            return NULL; // Нет свободного блока подходящего размера
+    }
+    remove_free_block(allocator, block, fl, sl);
+
+    // Остаток, в который помещается ещё один блок, возвращается в списки
+    if (block_size(block) >= adjusted + sizeof(block_header))
+    {
+        block_header *rest = (block_header *)((uint8_t *)block_to_ptr(block) + adjusted);
+        rest->prev_phys = block;
+        rest->size = block_size(block) - adjusted - BLOCK_OVERHEAD;
+        block_next(rest)->prev_phys = rest;
+        block->size = adjusted;
+        insert_free_block(allocator, rest);
+    }
+
+    return block_to_ptr(block);
+}
+
+// Функция для освобождения памяти
+EXPORT void allocator_free(Allocator *const allocator, void *const memory)
+{
+    if (allocator == NULL || memory == NULL)
+        return;
+
+    block_header *block = block_from_ptr(memory);
+    if (block_is_free(block))
+        return;
+
+    // Слияние с предыдущим и следующим блоками, если они свободны
+    block_header *prev = block->prev_phys;
+    if (prev && block_is_free(prev))
+    {
+        remove_block(allocator, prev);
+        prev->size += BLOCK_OVERHEAD + block_size(block);
+        block = prev;
+        block_next(block)->prev_phys = block;
+    }
+    block_header *next = block_next(block);
+    if (block_is_free(next))
+    {
+        remove_block(allocator, next);
+        block->size += BLOCK_OVERHEAD + block_size(next);
+        block_next(block)->prev_phys = block;
+    }
+
+    insert_free_block(allocator, block);
+}
+
+EXPORT size_t get_used_memory()
+{
+    return __USED_MEMORY;
+}